@@ -9,12 +9,14 @@
 
 #include "log_message.h"
 #include "kp_types.h"
+#include "hit_file.h"
 
 /* These variables are set by command line options. If there value is
    not NULL, the options they specify are enabled below. */
 static uchar *chimera_file = NULL;
 static uchar *database_name = NULL;
 static int verbosity_level;
+static int read_hitfiles = 0;
 
 static int *chimeric = NULL;
 static seqmeta_t *seqmeta = NULL;
@@ -276,6 +278,79 @@ static void load_scores(FILE *f) {
 #endif
 }
 
+static int fasta_compare(const void *a, const void *b) {
+  const fasta_t *x = a, *y = b;
+
+  if (x->s2 != y->s2) return x->s2 < y->s2 ? -1 : 1;
+  return y->score - x->score;
+}
+
+/* --hits: builds the adjacency lists straight from the binary hit files of
+   scan_sequences --binary, instead of reading the output of 
+   build_adjlist.pl. As there, each hit is an edge both ways with a score of
+   score - discount, and lists are sorted by neighbour; a neighbour found 
+   more than once keeps its best score. */
+static void load_hitfiles(int n_files, char **filenames) {
+  hitfile_t **hf;
+  hit_record_t *h;
+  fasta_t *list;
+  size_t r;
+  int k, i, j, *fill;
+
+  MA(hf, sizeof(hitfile_t *)*n_files);
+  for(k=0;k<n_files;k++) {
+    hf[k] = open_hitfile(filenames[k]);
+    if (database_name == NULL && k == 0) {
+      n_seq = hf[k]->header->n_seq;
+    } else if (hf[k]->header->n_seq != n_seq) {
+      logmsg(MSG_FATAL,"! Hit file %s is of a database of %u sequences, "
+	     "not %d\n", filenames[k], hf[k]->header->n_seq, n_seq);
+    }
+  }
+
+  CA(n_fasta, n_seq, sizeof(int));
+  for(k=0;k<n_files;k++) {
+    for(r=0;r<hf[k]->n_records;r++) {
+      h = hitfile_record(hf[k], r);
+      if (h->query >= n_seq || h->target >= n_seq) {
+	logmsg(MSG_FATAL,"! Hit file %s refers to sequences beyond the "
+	       "database\n", filenames[k]);
+      }
+      n_fasta[h->query]++;
+      n_fasta[h->target]++;
+    }
+  }
+  MA(fasta_scores, sizeof(fasta_t *)*n_seq);
+  CA(fill, n_seq, sizeof(int));
+  for(i=0;i<n_seq;i++) {
+    MA(fasta_scores[i], sizeof(fasta_t)*(n_fasta[i] > 0 ? n_fasta[i] : 1));
+  }
+  for(k=0;k<n_files;k++) {
+    for(r=0;r<hf[k]->n_records;r++) {
+      h = hitfile_record(hf[k], r);
+      list = fasta_scores[h->query] + fill[h->query]++;
+      list->s2 = h->target;
+      list->score = h->score - h->discount;
+      list = fasta_scores[h->target] + fill[h->target]++;
+      list->s2 = h->query;
+      list->score = h->score - h->discount;
+    }
+    close_hitfile(hf[k]);
+  }
+
+  for(i=0;i<n_seq;i++) {
+    list = fasta_scores[i];
+    qsort(list, n_fasta[i], sizeof(fasta_t), fasta_compare);
+    for(j=k=0;j<n_fasta[i];j++) {
+      if (k > 0 && list[k-1].s2 == list[j].s2) continue;
+      list[k++] = list[j];
+    }
+    n_fasta[i] = k;
+  }
+  free(fill);
+  free(hf);
+}
+
 static void usage(char *program_name) {
 
   fprintf(stderr,"\n\n%s:\n\n"
@@ -290,6 +365,9 @@ static void usage(char *program_name) {
 "--database=<basename> (-s) \n"
 "    Basename of preformatted sequence 'database' from which homology reports\n"
 "    are derived\n"
+"--hits (-H)\n"
+"    Read the binary hit files of scan_sequences --binary named on the\n"
+"    command line, instead of an adjacency list on standard input.\n"
 "--verbose=<integer> (-v)\n"
 "    Verbosity level. 0 (normal) by default. Negative enables debugging messages\n"
 "    Positive makes program quieter.\n"
@@ -308,11 +386,12 @@ static void parse_arguments(int argc, char *argv[]) {
   struct option longopts[] = {
     { "chimera", 1, NULL, 'c'},
     { "database", 1, NULL, 'd'},
+    { "hits", 0, NULL, 'H'},
     { "verbose", 1, NULL, 'v'},
     { "help", 1, NULL, 'h'},
     { NULL, 0, NULL, 0}
   };
-  char *optstring = "c:d:v:h";
+  char *optstring = "c:d:v:hH";
 
   commandline_error = 0;
   while((rval = getopt_long(argc, argv, optstring, longopts, &option_index))
@@ -332,6 +411,9 @@ static void parse_arguments(int argc, char *argv[]) {
     case 'c':
       chimera_file = strdup(optarg);
       break;
+    case 'H':
+      read_hitfiles = 1;
+      break;
     case 'h':
       usage(argv[0]);
       exit(0);
@@ -343,6 +425,12 @@ static void parse_arguments(int argc, char *argv[]) {
       break;
     }
   }
+
+  if (read_hitfiles && optind >= argc) {
+    logmsg(MSG_ERROR,"! --hits requires the hit files to be named on the "
+	   "command line\n");
+    commandline_error = 1;
+  }
   
   if (commandline_error) {
     logmsg(MSG_ERROR,"! Program halted due to command line option errors\n");
@@ -422,7 +510,11 @@ int main(int argc, char *argv[]) {
 
   n_seq = 0;
   if (database_name) load_seqnames(database_name);
-  load_scores(stdin);
+  if (read_hitfiles) {
+    load_hitfiles(argc - optind, argv + optind);
+  } else {
+    load_scores(stdin);
+  }
   CA(chimeric, n_seq, sizeof(int));
   if (chimera_file) load_chimeras(chimera_file);
   connected_components();
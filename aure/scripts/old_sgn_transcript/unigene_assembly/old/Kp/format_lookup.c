@@ -8,6 +8,7 @@
 
 #include "kp_types.h"
 #include "log_message.h"
+#include "lookup_table.h"
 
 static uchar *database_basename = NULL;
 static uchar *output_basename = NULL;
@@ -16,6 +17,26 @@ static int mem_coresize = 192;
 static uint wordsize = 9;
 static uint n_seq = -1;
 static int forward_only = 0;
+static int min_quality = 0;
+static int quality_report = 0;
+static int partition_words = 0;
+static uchar *stats_filename = NULL;
+static int stats_only = 0;
+static int sparse_index = 0;
+static double bloom_bits = 0.0;
+static uint fine_wordsize = 0;
+/* --part=<part_index>/<n_parts>: only sequences [part_start, part_end) */
+static int part_index = 0, n_parts = 0;
+static uint part_start, part_end;
+static int delta_mode = 0;
+/* Tables written, for <basename>.manifest */
+static manifest_entry_t *manifest = NULL;
+static int n_manifest = 0;
+
+/* Largest word size of a dense table, whose index holds a record for each
+   of the 4^wordsize possible words. Sparse tables censor as dense ones do
+   up to it (see build_sparsetable()) and take words up to 15. */
+#define DENSE_MAX_WORDSIZE 12
 
 static seqmeta_t *seqmeta = NULL;
 
@@ -36,6 +57,13 @@ static void usage(char *program_name) {
 "--memsize=<integer> (-m)						       \n"
 "    Assumed available core RAM size. Lookup tables will be made not much      \n"
 "    larger than this size. Value is in megabytes (MB)			       \n"
+"--partition=<sequences|words> (-p)					       \n"
+"    How the database is split between lookup tables. By default (sequences)   \n"
+"    each table covers every word of a range of sequences. With 'words', each  \n"
+"    table covers all sequences but only a range of the word space, so that    \n"
+"    a scan needs to read the queries only once per table host; scan each      \n"
+"    table with scan_sequences --partial and combine the results with         \n"
+"    scan_sequences --merge.                                                   \n"
 "--verbose=<integer> (-v)						       \n"
 "    Verbosity level. 0 (normal) by default. Negative enables debugging messages\n"
 "    Positive makes program quieter.                                           \n"
@@ -46,6 +74,59 @@ static void usage(char *program_name) {
 "    puts the reverse complement of the sequence after each input sequence.    \n"
 "    It is not necessary to compare a reverse complement with another 	       \n"
 "    reverse complement, that is the same as forward vs. forward.	       \n"
+"--min-quality=<integer> (-q)						       \n"
+"    Leave out of the lookup table any word containing a base with phred       \n"
+"    quality below this value. Requires <database>.qbin, written by            \n"
+"    format_seqdata --qualfile. 0 (no filtering) by default.                   \n"
+"--quality-report (-Q)							       \n"
+"    Do not build lookup tables. Instead, print to standard output the number  \n"
+"    of word postings each --min-quality threshold would leave out.            \n"
+"--wordsize=<integer> (-w)						       \n"
+"    Length of the indexed words, 2 to 12, or to 15 with --sparse. 9 by        \n"
+"    default. scan_sequences takes the word size from the lookup table header. \n"
+"--stats=<file> (-S)							       \n"
+"    Write index statistics for every lookup table to <file> (- for standard   \n"
+"    output) as JSON: posting-length histogram, heaviest words, share of the   \n"
+"    postings held by the heaviest words, bytes used by metadata and postings  \n"
+"    and the predicted cost of scanning the whole database (both strands)      \n"
+"    against the table with scan_sequences.                                    \n"
+"--stats-only (-T)							       \n"
+"    Only count words and write statistics (to standard output unless --stats \n"
+"    is given); no lookup table is filled or written. Useful to try wordsize   \n"
+"    and memsize choices.                                                      \n"
+"--sparse (-s)								       \n"
+"    Write sparse lookup tables, which store only the words that occur. The    \n"
+"    dense format holds a record for each of the 4^wordsize possible words, so \n"
+"    it is needed for word sizes above 12. Built by sorting the postings,      \n"
+"    so --memsize also bounds the memory used while building. Words are      \n"
+"    censored as in dense tables up to word size 12; above it, words with     \n"
+"    at most 50 postings are never censored.                                   \n"
+"--bloom=<bits per word> (-b)						       \n"
+"    With --sparse, add a cache line blocked Bloom filter of this many bits    \n"
+"    per indexed word (10 is a good choice) to each table. scan_sequences      \n"
+"    tests it before looking a word up, which rejects most absent words with   \n"
+"    one memory access. 0 (no filter) by default.                              \n"
+"--fine-wordsize=<integer> (-F)						       \n"
+"    With --sparse, build a layered index: next to each (coarse) table         \n"
+"    <basename>.lt.N, write <basename>.lt.N.fine holding the words of this     \n"
+"    shorter length for each sequence of the table, collected in the same     \n"
+"    pass. scan_sequences --refine finds candidate targets with the coarse     \n"
+"    words and looks for short word hits only in those candidates.             \n"
+"--part=<i>/<n> (-P)							       \n"
+"    Index only the i-th of n parts of the database (1 <= i <= n), split at    \n"
+"    sequence boundaries into parts of about the same length, for building   \n"
+"    the index on several hosts or processes. Tables are written as           \n"
+"    <database>.p<i>.lt.N unless --basename is given, and words are not       \n"
+"    censored: combine the tables of all parts with merge_lookup, which       \n"
+"    censors the merged table. parallel_lookup.pl runs this locally.          \n"
+"--delta (-D)								       \n"
+"    Index only the sequences appended to the database since the tables       \n"
+"    listed in <basename>.manifest were built, as new tables listed there as   \n"
+"    deltas. The word size and censored words are those of the existing       \n"
+"    tables; use the same --min-quality and --forward-only. scan_sequences     \n"
+"    --manifest probes them together with the base tables, and merge_lookup  \n"
+"    --manifest folds them into the base. Every build writes the manifest,    \n"
+"    except with --part, where merge_lookup writes it.                        \n"
 "--help (-h)                                                                   \n"
 "    Prints this message.						       \n"
 "									       \n"
@@ -60,12 +141,23 @@ static void parse_arguments(int argc, char *argv[]) {
     { "database", 1, NULL, 'd'},
     { "basename", 1, NULL, 'o'},
     { "memsize", 1, NULL, 'm'},
+    { "partition", 1, NULL, 'p'},
     { "verbose", 1, NULL, 'v'},
     { "forward-only", 0, NULL, 'f'},
+    { "min-quality", 1, NULL, 'q'},
+    { "quality-report", 0, NULL, 'Q'},
+    { "wordsize", 1, NULL, 'w'},
+    { "stats", 1, NULL, 'S'},
+    { "stats-only", 0, NULL, 'T'},
+    { "sparse", 0, NULL, 's'},
+    { "bloom", 1, NULL, 'b'},
+    { "fine-wordsize", 1, NULL, 'F'},
+    { "part", 1, NULL, 'P'},
+    { "delta", 0, NULL, 'D'},
     { "help", 0, NULL, 'h'},
     { NULL, 0, NULL, 0}
   };
-  char *optstring = "d:v:o:m:hf";
+  char *optstring = "d:v:o:m:p:q:w:S:b:F:P:hfQTsD";
 
   database_basename = output_basename = NULL;
   commandline_error = 0;
@@ -89,9 +181,54 @@ static void parse_arguments(int argc, char *argv[]) {
     case 'm':
       mem_coresize = atoi(optarg);
       break;
+    case 'p':
+      if (strcmp(optarg, "words") == 0) {
+	partition_words = 1;
+      } else if (strcmp(optarg, "sequences") == 0) {
+	partition_words = 0;
+      } else {
+	logmsg(MSG_ERROR,"\n! Unknown partitioning \"%s\"\n",optarg);
+	commandline_error = 1;
+      }
+      break;
     case 'f':
       forward_only = 1;
       break;
+    case 'q':
+      min_quality = atoi(optarg);
+      break;
+    case 'Q':
+      quality_report = 1;
+      break;
+    case 'w':
+      wordsize = atoi(optarg);
+      break;
+    case 'S':
+      stats_filename = strdup(optarg);
+      break;
+    case 'T':
+      stats_only = 1;
+      break;
+    case 's':
+      sparse_index = 1;
+      break;
+    case 'b':
+      bloom_bits = atof(optarg);
+      break;
+    case 'F':
+      fine_wordsize = atoi(optarg);
+      break;
+    case 'D':
+      delta_mode = 1;
+      break;
+    case 'P':
+      if (sscanf(optarg, "%d/%d", &part_index, &n_parts) != 2 ||
+	  n_parts < 1 || part_index < 1 || part_index > n_parts) {
+	logmsg(MSG_ERROR,"\n! Invalid part \"%s\", expected <i>/<n> with "
+	       "1 <= i <= n\n",optarg);
+	commandline_error = 1;
+      }
+      break;
     case 'h':
       usage(argv[0]);
       exit(0);
@@ -115,19 +252,77 @@ static void parse_arguments(int argc, char *argv[]) {
 	   "0\n");
     commandline_error = 1;
   }
+
+  if (wordsize < 2 || wordsize > (sparse_index ? 15 : DENSE_MAX_WORDSIZE)) {
+    logmsg(MSG_ERROR,"! Word size must be between 2 and %d, or 15 with "
+	   "--sparse\n", DENSE_MAX_WORDSIZE);
+    commandline_error = 1;
+  }
+
+  if (min_quality < 0 || min_quality > 255) {
+    logmsg(MSG_ERROR,"! Minimum base quality must be between 0 and 255\n");
+    commandline_error = 1;
+  }
   
+  if (bloom_bits < 0.0 || bloom_bits > 64.0) {
+    logmsg(MSG_ERROR,"! Bloom filter size must be between 0 and 64 bits per "
+	   "word\n");
+    commandline_error = 1;
+  }
+
+  if (bloom_bits > 0.0 && !sparse_index) {
+    logmsg(MSG_ERROR,"! --bloom requires --sparse\n");
+    commandline_error = 1;
+  }
+
+  if (fine_wordsize && (!sparse_index || fine_wordsize < 2 || 
+			fine_wordsize >= wordsize || fine_wordsize > 12)) {
+    logmsg(MSG_ERROR,"! --fine-wordsize requires --sparse and must be between "
+	   "2 and 12, and smaller than --wordsize\n");
+    commandline_error = 1;
+  }
+
+  if (delta_mode && (n_parts || partition_words || sparse_index || 
+		     quality_report || stats_only)) {
+    logmsg(MSG_ERROR,"! --delta only adds dense tables, and can not be "
+	   "combined with --part, --partition=words, --sparse, --stats-only or "
+	   "--quality-report\n");
+    commandline_error = 1;
+  }
+
+  if (n_parts && (partition_words || sparse_index || quality_report)) {
+    logmsg(MSG_ERROR,"! --part can not be combined with --partition=words, "
+	   "--sparse or --quality-report\n");
+    commandline_error = 1;
+  }
+
+  if (sparse_index && (partition_words || stats_filename || stats_only)) {
+    logmsg(MSG_ERROR,"! --sparse can not be combined with --partition=words "
+	   "or --stats\n");
+    commandline_error = 1;
+  }
+
   if (commandline_error) {
     logmsg(MSG_ERROR,"! Program halted due to command line option errors\n");
     usage(argv[0]);
     exit(-1);
   }
 
+  if (output_basename == NULL && n_parts) {
+    MA(output_basename, strlen(database_basename) + 16);
+    sprintf(output_basename, "%s.p%d", database_basename, part_index);
+  }
   if (output_basename == NULL) {
     output_basename = strdup(database_basename);
   }
+
+  if (stats_only && stats_filename == NULL) {
+    stats_filename = strdup("-");
+  }
 }
 
-static void open_databasefiles(FILE **indfile, FILE **binfile) {
+static void open_databasefiles(FILE **indfile, FILE **binfile, 
+			       FILE **qualfile) {
   int l;
   uchar *temp;
   uint x;
@@ -164,50 +359,208 @@ static void open_databasefiles(FILE **indfile, FILE **binfile) {
   }
   *binfile = f;
 
+  /* Quality values share the offsets of the binary sequence file */
+  *qualfile = NULL;
+  if (min_quality > 0 || quality_report) {
+    strcpy(temp, database_basename);
+    strcat(temp, ".qbin");
+    f = fopen(temp, "r");
+    if (f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening database quality file %s (%s)\n",
+	     temp, strerror(errno));
+    }
+    fread(&x, sizeof(uint), 1, f);
+    if (x != QUALFILE_MAGIC) {
+      logmsg(MSG_FATAL,"! Database quality file does not appear to be properly formatted\n");
+    }
+    *qualfile = f;
+  }
+
   free(temp);
 }
 
-static void write_header(FILE *f, uint start, uint stop, uint table_size, int tn) {
-  uint x;
-  
-  x = LOOKUP_MAGIC;
-  fwrite(&x, sizeof(uint), 1, f);
+/* Reads the quality values for sequence <seq_id> into <qual>, when quality
+   filtering is in effect. The quality file is positioned independently of the
+   binary sequence file, but at the same offsets. */
+static void read_quality(FILE *qualfile, uint seq_id, uchar *qual, int length) {
+
+  if (qualfile == NULL) return;
+  fseek(qualfile, seqmeta[seq_id].seqbin_pos, SEEK_SET);
+  fread(qual, sizeof(uchar), length, qualfile);
+}
 
-  fwrite(&wordsize, sizeof(uint), 1, f);
-  fwrite(&start, sizeof(uint), 1, f);
-  fwrite(&stop, sizeof(uint), 1, f);
-  fwrite(&tn, sizeof(int), 1, f);
-  fwrite(&table_size, sizeof(uint), 1, f);
+/* Counts (fill == NULL) or records (fill != NULL) the postings for the words
+   of one sequence which fall in [word_start, word_end). <lookup_meta> and 
+   <fill> are indexed by word - word_start. Words containing a base below 
+   min_quality are left out and counted in *skipped. When recording, words
+   with no postings counted (i.e. censored words) are left out as well.
+   Returns the number of postings counted or recorded. */
+static uint index_sequence(uchar *seq, uchar *qual, int length, uint seq_id,
+			   uint word_start, uint word_end, 
+			   lookupmeta_t *lookup_meta, int *fill, 
+			   word_t *lookup_data, uint *skipped) {
+  uint word, mask, n, w;
+  int j, last_low;
 
+  mask = (0x1 << wordsize*2) - 1;
+  n = 0;
+  word = 0;
+  /* last_low is the position of the most recent base below min_quality; a 
+     word ending at position j is indexed only if j - last_low >= wordsize */
+  last_low = -1;
+  for(j=0;j<length;j++) {
+    word = ((word << 2) & mask) | seq[j];
+    if (qual && qual[j] < min_quality) last_low = j;
+    if (j < wordsize - 1) continue;
+    if (j - last_low < wordsize) {
+      (*skipped)++;
+      continue;
+    }
+    if (word < word_start || word >= word_end) continue;
+    w = word - word_start;
+    if (fill == NULL) {
+      lookup_meta[w].n_words++;
+    } else {
+      if (lookup_meta[w].n_words == 0) continue;
+      lookup_data[fill[w]].seq_id = seq_id;
+      /* The first word of a sequence and the one following it are both
+	 recorded at position 0, as scan_sequences expects */
+      lookup_data[fill[w]].seq_pos = (j == wordsize - 1) ? 0 : j - wordsize;
+      fill[w]++;
+    }
+    n++;
+  }
+
+  return n;
 }
 
-static uint build_lookuptable(lookupmeta_t *lookup_meta, word_t **ld,
-			      uint *total_words, uint start_seq, 
-			      FILE *binfile) {
+/* Words occuring far more often than expected at random (simple sequence 
+   repeats, vector, poly-A, etc.) are left out of the lookup table. Returns 
+   the number of postings censored. */
+typedef struct {
+  uint word;
+  uint n_words;
+} censored_t;
+
+/* Words censored by the last call of censor_words(), kept for --stats */
+static censored_t *censored_list = NULL;
+static int n_censored = 0;
+
+static uint censor_words(lookupmeta_t *lookup_meta, uint total) {
   uint word, mask;
+  double p, expect;
+  uint censored;
+
+  mask = (0x1 << wordsize*2) - 1;
+  p = 1.0/(double) mask;
+  expect = p*total;
+  censored = 0;
+  n_censored = 0;
+  for(word=0;word<=mask;word++) {
+    if (lookup_meta[word].n_words > expect*50) {
+      logmsg(MSG_DEBUG1,"Censoring word: %0X (%d obs out of %d total, "
+	     "expect = %5.2f)\n",word, lookup_meta[word].n_words, total, 
+	     expect);
+      PUSH(censored_list, n_censored, sizeof(censored_t));
+      censored_list[n_censored].word = word;
+      censored_list[n_censored].n_words = lookup_meta[word].n_words;
+      n_censored++;
+      censored += lookup_meta[word].n_words;
+      lookup_meta[word].n_words = 0;
+      lookup_meta[word].start_pos = CENSORED_WORD;
+    }
+  }
+  if (n_censored > 0) {
+    logmsg(MSG_INFO,"Censored %d over-represented words (%u postings)\n",
+	   n_censored, censored);
+  }
+
+  return censored;
+}
+
+/* --delta: words censored in any table of the manifest, 1 byte per word */
+static uchar *delta_censored = NULL;
+
+static uint censor_inherited(lookupmeta_t *lookup_meta) {
+  uint word, mask, censored;
+
+  mask = (0x1 << wordsize*2) - 1;
+  censored = 0;
+  for(word=0;word<=mask;word++) {
+    if (!delta_censored[word]) continue;
+    censored += lookup_meta[word].n_words;
+    lookup_meta[word].n_words = 0;
+    lookup_meta[word].start_pos = CENSORED_WORD;
+  }
+  return censored;
+}
+
+/* Computes fill pointers and file offsets (start_pos) for the words covered 
+   by the table described by <h>. <lookup_meta> points to the record of 
+   h->word_start. */
+static void compute_offsets(lookup_header_t *h, lookupmeta_t *lookup_meta,
+			    int *fill) {
+  uint w, n, offset;
+
+  n = h->word_end - h->word_start;
+  offset = lookup_header_size(h) + sizeof(lookupmeta_t)*n;
+  for(w=0;w<n;w++) {
+    fill[w] = w ? fill[w-1] + lookup_meta[w-1].n_words : 0;
+    if (lookup_meta[w].start_pos != CENSORED_WORD) {
+      lookup_meta[w].start_pos = offset;
+    }
+    offset += lookup_meta[w].n_words*sizeof(word_t);
+  }
+}
+
+static void write_lookuptable(uchar *lookup_filename, lookup_header_t *h,
+			      lookupmeta_t *lookup_meta, word_t *lookup_data) {
+  FILE *lf;
+
+  lf = fopen(lookup_filename, "w");
+  if (lf == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
+	   lookup_filename, strerror(errno));
+  }
+  write_lookup_header(lf, h);
+  fwrite(lookup_meta, sizeof(lookupmeta_t), h->word_end - h->word_start, lf);
+  fwrite(lookup_data, sizeof(word_t), h->table_size, lf);
+  fclose(lf);
+}
+
+static void add_to_manifest(uchar *lookup_filename, int delta) {
+
+  PUSH(manifest, n_manifest, sizeof(manifest_entry_t));
+  manifest[n_manifest].filename = strdup(lookup_filename);
+  manifest[n_manifest].delta = delta;
+  n_manifest++;
+}
+
+static uint build_lookuptable(lookup_header_t *h, lookupmeta_t *lookup_meta,
+			      word_t **ld, uint start_seq, 
+			      FILE *binfile, FILE *qualfile) {
   uint limit;
-  int length, j, total, seqsize;
-  uchar *seq;
+  int length, total, seqsize;
+  uchar *seq, *qual;
   uint seq_id, end_seq;
   int *fill;
   word_t *lookup_data;
-  double p, var, expect;
-  uint censored;
+  uint censored, skipped;
   
   limit = (mem_coresize*1024*1024)/sizeof(word_t);
 
-  mask = (0x1 << wordsize*2) - 1;
-
-  seq = NULL;
+  seq = qual = NULL;
   seqsize = 0;
   total = 0;
+  skipped = 0;
   seq_id = start_seq;
   fseek(binfile, seqmeta[start_seq].seqbin_pos, SEEK_SET);
-  while(seq_id<n_seq && total < limit) {
+  while(seq_id<part_end && total < limit) {
     length = seqmeta[seq_id].seq_length;
     if (seqsize < length) {
       seqsize = length;
       RA(seq, seqsize, sizeof(uchar));
+      RA(qual, seqsize, sizeof(uchar));
     }
 
     fread(seq, sizeof(uchar), length, binfile);
@@ -217,49 +570,39 @@ static uint build_lookuptable(lookupmeta_t *lookup_meta, word_t **ld,
       seq_id++;
       continue;
     }
-    word = 0;
-    for(j=0;j<wordsize;j++) {
-      word = (word << 2) | seq[j];
-    }
-    lookup_meta[word].n_words++;
-    total++;
-    for(;j<length;j++) {
-      word = ((word << 2) & mask) | seq[j];
-      lookup_meta[word].n_words++;
-      total++;
-    }
-
+    read_quality(qualfile, seq_id, qual, length);
+    total += index_sequence(seq, qualfile ? qual : NULL, length, seq_id, 
+			    h->word_start, h->word_end, lookup_meta, NULL, 
+			    NULL, &skipped);
     seq_id++;
   }
+  if (qualfile) {
+    logmsg(MSG_INFO,"Left out %u words containing bases below quality %d "
+	   "(%u words kept)\n",skipped, min_quality, total);
+  }
 
-  p = 1.0/(double) mask;
-  expect = p*total;
-  var = p*(1.0-p);
-  censored = 0;
-  for(word=0;word<=mask;word++) {
-    if (lookup_meta[word].n_words > expect*50) {
-      fprintf(stderr,"Censoring word: %0X (%d obs out of %d total, expect = %5.2f)\n",word,
-	      lookup_meta[word].n_words, total, expect);
-      censored += lookup_meta[word].n_words;
-      lookup_meta[word].n_words = 0;
-    }
+  /* Parts are censored when merge_lookup puts them together, and deltas
+     leave out the words censored in the tables they are added to */
+  if (delta_censored) {
+    censored = censor_inherited(lookup_meta);
+  } else if (n_parts) {
+    censored = 0;
+  } else {
+    censored = censor_words(lookup_meta, total);
   }
-  //  total -= censored;
+  total -= censored;
 
-  MA(fill, sizeof(int)*(mask+1));
-  MA(lookup_data, total*sizeof(word_t));
-  fill[0] = 0;
-  lookup_meta[0].start_pos = 5*sizeof(uint) + sizeof(lookupmeta_t)*(mask+1);
-  for(word=1;word<=mask;word++) {
-    fill[word] = fill[word-1] + lookup_meta[word-1].n_words;
-    lookup_meta[word].start_pos = lookup_meta[word-1].start_pos + 
-      lookup_meta[word-1].n_words*sizeof(word_t);
+  MA(fill, sizeof(int)*(h->word_end - h->word_start));
+  lookup_data = NULL;
+  if (!stats_only) {
+    MA(lookup_data, total*sizeof(word_t));
   }
+  compute_offsets(h, lookup_meta, fill);
 
   end_seq = seq_id;
   seq_id = start_seq;
   fseek(binfile, seqmeta[start_seq].seqbin_pos, SEEK_SET);
-  while(seq_id < end_seq) {
+  while(seq_id < end_seq && !stats_only) {
     length = seqmeta[seq_id].seq_length;
     fread(seq, sizeof(uchar), length, binfile);
     /* Cheap hack to prevent cataloging of reverse complement sequences which
@@ -268,73 +611,920 @@ static uint build_lookuptable(lookupmeta_t *lookup_meta, word_t **ld,
       seq_id++;
       continue;
     }
-    word = 0;
-    for(j=0;j<wordsize;j++) {
-      word = (word << 2) | seq[j];
+    read_quality(qualfile, seq_id, qual, length);
+    index_sequence(seq, qualfile ? qual : NULL, length, seq_id, 
+		   h->word_start, h->word_end, lookup_meta, fill, 
+		   lookup_data, &skipped);
+    seq_id++;
+  }
+
+  free(fill);
+  free(seq);
+  free(qual);
+  *ld = lookup_data;
+  h->seq_start = start_seq;
+  h->seq_end = end_seq - 1;
+  h->table_size = total;
+  return (end_seq - start_seq - 1);
+}
+
+/* Prints, for each quality threshold, how many word postings --min-quality
+   would leave out of the lookup tables. A word is left out at threshold t
+   when the lowest quality base it contains is below t, so a histogram of
+   the per-word minimum quality gives the answer for every threshold at 
+   once. */
+static void report_quality_savings(FILE *qualfile) {
+  uint seq_id;
+  int length, qualsize, j, k, min_q, max_q;
+  uchar *qual;
+  double hist[256], total, skipped;
+
+  for(j=0;j<256;j++) hist[j] = 0.0;
+
+  qual = NULL;
+  qualsize = 0;
+  for(seq_id=0;seq_id<n_seq;seq_id++) {
+    length = seqmeta[seq_id].seq_length;
+    if (forward_only && (seq_id & 0x1)) continue;
+    if (qualsize < length) {
+      qualsize = length;
+      RA(qual, qualsize, sizeof(uchar));
     }
-    lookup_data[fill[word]].seq_id = seq_id;
-    lookup_data[fill[word]].seq_pos = 0;
-    fill[word]++;
-    for(;j<length;j++) {
-      word = ((word << 2) & mask) | seq[j];
-      lookup_data[fill[word]].seq_id = seq_id;
-      lookup_data[fill[word]].seq_pos = j - wordsize;
-      fill[word]++;
+    read_quality(qualfile, seq_id, qual, length);
+
+    for(j=wordsize-1;j<length;j++) {
+      min_q = qual[j];
+      for(k=j-wordsize+1;k<j;k++)
+	if (qual[k] < min_q) min_q = qual[k];
+      hist[min_q] += 1.0;
     }
+  }
 
+  total = 0.0;
+  max_q = 0;
+  for(j=0;j<256;j++) {
+    total += hist[j];
+    if (hist[j] > 0.0) max_q = j;
+  }
+
+  fprintf(stdout,"#min_quality\tpostings_left_out\tpercent\tpostings_kept\n");
+  skipped = 0.0;
+  for(j=0;j<=max_q+1 && j<256;j++) {
+    fprintf(stdout,"%d\t%.0f\t%.2f\t%.0f\n",j,skipped,
+	    total > 0.0 ? 100.0*skipped/total : 0.0, total - skipped);
+    skipped += hist[j];
+  }
+
+  free(qual);
+}
+
+/* Reads every sequence of the database in turn, either counting or recording
+   the postings of words in [h->word_start, h->word_end) */
+static uint index_database(lookup_header_t *h, lookupmeta_t *lookup_meta,
+			   int *fill, word_t *lookup_data, 
+			   FILE *binfile, FILE *qualfile, uint *skipped) {
+  uint seq_id, total;
+  int length, seqsize;
+  uchar *seq, *qual;
+
+  seq = qual = NULL;
+  seqsize = 0;
+  total = 0;
+  fseek(binfile, seqmeta[0].seqbin_pos, SEEK_SET);
+  for(seq_id=0;seq_id<n_seq;seq_id++) {
+    length = seqmeta[seq_id].seq_length;
+    if (seqsize < length) {
+      seqsize = length;
+      RA(seq, seqsize, sizeof(uchar));
+      RA(qual, seqsize, sizeof(uchar));
+    }
+    fread(seq, sizeof(uchar), length, binfile);
+    if (forward_only && (seq_id & 0x1)) continue;
+    read_quality(qualfile, seq_id, qual, length);
+    total += index_sequence(seq, qualfile ? qual : NULL, length, seq_id, 
+			    h->word_start, h->word_end, lookup_meta, fill,
+			    lookup_data, skipped);
+  }
+  free(seq);
+  free(qual);
+
+  return total;
+}
+
+/* --sparse support. Instead of counting into a lookupmeta_t per possible
+   word, the postings of a range of sequences are collected together with
+   their word and sorted, so that memory use depends only on the number of
+   postings and word sizes up to 15 can be indexed. */
+typedef struct {
+  uint word;
+  uint seq_id;
+  uint seq_pos;
+} posting_t;
+
+static int posting_compare(const void *a, const void *b) {
+  const posting_t *x = a, *y = b;
+
+  if (x->word != y->word) return x->word < y->word ? -1 : 1;
+  if (x->seq_id != y->seq_id) return x->seq_id < y->seq_id ? -1 : 1;
+  if (x->seq_pos != y->seq_pos) return x->seq_pos < y->seq_pos ? -1 : 1;
+  return 0;
+}
+
+/* Same word and quality rules as index_sequence(), for words of length k */
+static uint collect_postings(uchar *seq, uchar *qual, int length, 
+			     uint seq_id, uint k, posting_t **postings, 
+			     uint *n, uint *allocsize, uint *skipped) {
+  uint word, mask, start;
+  int j, last_low;
+
+  mask = (0x1 << k*2) - 1;
+  start = *n;
+  word = 0;
+  last_low = -1;
+  for(j=0;j<length;j++) {
+    word = ((word << 2) & mask) | seq[j];
+    if (qual && qual[j] < min_quality) last_low = j;
+    if (j < k - 1) continue;
+    if (j - last_low < k) {
+      (*skipped)++;
+      continue;
+    }
+    if (*n == *allocsize) {
+      *allocsize = *allocsize ? *allocsize*2 : 65536;
+      RA(*postings, *allocsize, sizeof(posting_t));
+    }
+    (*postings)[*n].word = word;
+    (*postings)[*n].seq_id = seq_id;
+    (*postings)[*n].seq_pos = (j == k - 1) ? 0 : j - k;
+    (*n)++;
+  }
+
+  return *n - start;
+}
+
+/* --fine-wordsize support. The short word layer of a layered index is
+   collected in the same pass over the sequences as the sparse table, one
+   sorted word list per sequence, and written next to it as <table>.fine */
+static fineword_t *fine_words = NULL;
+static uint n_fine = 0, fine_allocsize = 0;
+static uint *fine_offsets = NULL;
+static uint n_fine_offsets = 0, fine_offsets_allocsize = 0;
+static posting_t *fine_buffer = NULL;
+static uint fine_buffer_allocsize = 0, fine_skipped = 0;
+
+/* Appends the fine words of one sequence; seq is NULL for a sequence left
+   out by --forward-only, which gets an empty list */
+static void fine_add_sequence(uchar *seq, uchar *qual, int length, 
+			      uint seq_id) {
+  uint i, n;
+
+  if (n_fine_offsets == fine_offsets_allocsize) {
+    fine_offsets_allocsize = fine_offsets_allocsize ? 
+      fine_offsets_allocsize*2 : 1024;
+    RA(fine_offsets, fine_offsets_allocsize, sizeof(uint));
+  }
+  fine_offsets[n_fine_offsets++] = n_fine;
+  if (seq == NULL) return;
+
+  n = 0;
+  collect_postings(seq, qual, length, seq_id, fine_wordsize, &fine_buffer,
+		   &n, &fine_buffer_allocsize, &fine_skipped);
+  qsort(fine_buffer, n, sizeof(posting_t), posting_compare);
+  if (n_fine + n > fine_allocsize) {
+    while(n_fine + n > fine_allocsize) {
+      fine_allocsize = fine_allocsize ? fine_allocsize*2 : 65536;
+    }
+    RA(fine_words, fine_allocsize, sizeof(fineword_t));
+  }
+  for(i=0;i<n;i++) {
+    fine_words[n_fine].word = fine_buffer[i].word;
+    fine_words[n_fine].pos = fine_buffer[i].seq_pos;
+    n_fine++;
+  }
+}
+
+/* Censors the fine layer of the table just built with the rule used for 
+   sparse tables, writes it and resets the layer for the next table */
+static void fine_write_table(lookup_header_t *coarse, uchar *filename) {
+  lookup_header_t h;
+  uint *counts, n_words, i, j, s, censored;
+  double expect;
+  FILE *lf;
+
+  n_words = 0x1 << (fine_wordsize*2);
+  CA(counts, n_words, sizeof(uint));
+  for(i=0;i<n_fine;i++) counts[fine_words[i].word]++;
+  expect = (double) n_fine/(double) (n_words - 1);
+  if (expect < 1.0) expect = 1.0;
+
+  /* Compact every list in place, dropping the censored words */
+  fine_offsets[n_fine_offsets++] = n_fine;
+  censored = 0;
+  for(s=0, j=0;s<n_fine_offsets - 1;s++) {
+    i = fine_offsets[s];
+    fine_offsets[s] = j;
+    for(;i<fine_offsets[s+1];i++) {
+      if (counts[fine_words[i].word] > expect*50) {
+	censored++;
+	continue;
+      }
+      fine_words[j++] = fine_words[i];
+    }
+  }
+  fine_offsets[n_fine_offsets - 1] = j;
+  n_fine = j;
+  free(counts);
+
+  init_lookup_header(&h, fine_wordsize);
+  h.seq_start = coarse->seq_start;
+  h.seq_end = coarse->seq_end;
+  h.table_index = coarse->table_index;
+  h.table_size = n_fine;
+  h.flags = LOOKUP_FINE;
+  assert(n_fine_offsets == h.seq_end - h.seq_start + 2);
+
+  logmsg(MSG_INFO,"Writing fine layer %s: %u words of length %u (%u "
+	 "censored)\n", filename, n_fine, fine_wordsize, censored);
+  lf = fopen(filename, "w");
+  if (lf == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
+	   filename, strerror(errno));
+  }
+  write_lookup_header(lf, &h);
+  fwrite(fine_offsets, sizeof(uint), n_fine_offsets, lf);
+  fwrite(fine_words, sizeof(fineword_t), n_fine, lf);
+  fclose(lf);
+
+  n_fine = 0;
+  n_fine_offsets = 0;
+}
+
+/* Sparse counterpart of build_lookuptable(). Returns the sorted keys, the
+   Bloom filter (if bloom_bits > 0) and postings of the table starting at
+   sequence <start_seq>. Censoring follows censor_words(), so that sparse
+   and dense tables of the same database give the same hits, except that
+   above DENSE_MAX_WORDSIZE the threshold never drops below 50 postings: 
+   with long words the expected count per word is far below one and the 
+   dense rule would censor nearly every word. */
+static uint build_sparsetable(lookup_header_t *h, sparsemeta_t **k, 
+			      uint **b, word_t **ld, uint start_seq, 
+			      FILE *binfile, FILE *qualfile) {
+  uint limit, total, allocsize, skipped, censored, seq_id, i, j, n;
+  uint n_keys, offset;
+  int length, seqsize;
+  uchar *seq, *qual;
+  posting_t *postings;
+  sparsemeta_t *keys;
+  word_t *lookup_data;
+  uint *bloom;
+  double expect;
+
+  limit = (mem_coresize*1024*1024)/sizeof(word_t);
+
+  seq = qual = NULL;
+  seqsize = 0;
+  postings = NULL;
+  total = allocsize = skipped = 0;
+  seq_id = start_seq;
+  fseek(binfile, seqmeta[start_seq].seqbin_pos, SEEK_SET);
+  while(seq_id<n_seq && total < limit) {
+    length = seqmeta[seq_id].seq_length;
+    if (seqsize < length) {
+      seqsize = length;
+      RA(seq, seqsize, sizeof(uchar));
+      RA(qual, seqsize, sizeof(uchar));
+    }
+    fread(seq, sizeof(uchar), length, binfile);
+    if (forward_only && (seq_id & 0x1)) {
+      if (fine_wordsize) fine_add_sequence(NULL, NULL, 0, seq_id);
+      seq_id++;
+      continue;
+    }
+    read_quality(qualfile, seq_id, qual, length);
+    collect_postings(seq, qualfile ? qual : NULL, length, seq_id, wordsize,
+		     &postings, &total, &allocsize, &skipped);
+    if (fine_wordsize) {
+      fine_add_sequence(seq, qualfile ? qual : NULL, length, seq_id);
+    }
     seq_id++;
   }
+  if (qualfile) {
+    logmsg(MSG_INFO,"Left out %u words containing bases below quality %d "
+	   "(%u words kept)\n",skipped, min_quality, total);
+  }
+  free(seq);
+  free(qual);
+
+  qsort(postings, total, sizeof(posting_t), posting_compare);
+
+  expect = (double) total/(double) ((0x1 << wordsize*2) - 1);
+  if (expect < 1.0 && wordsize > DENSE_MAX_WORDSIZE) expect = 1.0;
+
+  keys = NULL;
+  MA(lookup_data, sizeof(word_t)*(total > 0 ? total : 1));
+  n_keys = n = censored = 0;
+  for(i=0;i<total;i=j) {
+    for(j=i+1;j<total && postings[j].word == postings[i].word;j++);
+    if (j - i > expect*50) {
+      logmsg(MSG_DEBUG1,"Censoring word: %0X (%d obs out of %d total)\n",
+	     postings[i].word, j - i, total);
+      censored += j - i;
+      continue;
+    }
+    PUSH(keys, n_keys, sizeof(sparsemeta_t));
+    keys[n_keys].word = postings[i].word;
+    keys[n_keys].n_words = j - i;
+    keys[n_keys].start_pos = n;
+    n_keys++;
+    for(;i<j;i++) {
+      lookup_data[n].seq_id = postings[i].seq_id;
+      lookup_data[n].seq_pos = postings[i].seq_pos;
+      n++;
+    }
+  }
+  free(postings);
+  if (censored > 0) {
+    logmsg(MSG_INFO,"Censored %u over-represented postings\n", censored);
+  }
 
+  h->flags = LOOKUP_SPARSE;
+  h->n_keys = n_keys;
+  h->bloom_blocks = 0;
+  h->bloom_probes = 0;
+  bloom = NULL;
+  if (bloom_bits > 0 && n_keys > 0) {
+    h->bloom_blocks = ((double) n_keys*bloom_bits + BLOOM_BLOCK_BITS - 1)/
+      BLOOM_BLOCK_BITS;
+    h->bloom_probes = (uint) (bloom_bits*0.693 + 0.5);
+    if (h->bloom_probes < 1) h->bloom_probes = 1;
+    if (h->bloom_probes > 8) h->bloom_probes = 8;
+    CA(bloom, h->bloom_blocks*BLOOM_BLOCK_UINTS, sizeof(uint));
+    for(i=0;i<n_keys;i++) {
+      bloom_insert(bloom, h->bloom_blocks, h->bloom_probes, keys[i].word);
+    }
+  }
+
+  offset = lookup_header_size(h) + n_keys*sizeof(sparsemeta_t) + 
+    h->bloom_blocks*BLOOM_BLOCK_UINTS*sizeof(uint);
+  for(i=0;i<n_keys;i++) {
+    keys[i].start_pos = offset + keys[i].start_pos*sizeof(word_t);
+  }
+
+  *k = keys;
+  *b = bloom;
   *ld = lookup_data;
-  *total_words = total;
-  return (end_seq - start_seq - 1);
+  h->seq_start = start_seq;
+  h->seq_end = seq_id - 1;
+  h->table_size = n;
+  return (seq_id - start_seq - 1);
+}
+
+static void write_sparsetable(uchar *lookup_filename, lookup_header_t *h,
+			      sparsemeta_t *keys, uint *bloom,
+			      word_t *lookup_data) {
+  FILE *lf;
+
+  lf = fopen(lookup_filename, "w");
+  if (lf == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
+	   lookup_filename, strerror(errno));
+  }
+  write_lookup_header(lf, h);
+  fwrite(keys, sizeof(sparsemeta_t), h->n_keys, lf);
+  fwrite(bloom, sizeof(uint), h->bloom_blocks*BLOOM_BLOCK_UINTS, lf);
+  fwrite(lookup_data, sizeof(word_t), h->table_size, lf);
+  fclose(lf);
+}
+
+static void create_sparse_tables(FILE *binfile, FILE *qualfile) {
+  int table_number;
+  uint i, n, *bloom;
+  uchar *lookup_filename;
+  sparsemeta_t *keys;
+  word_t *lookup_data;
+  lookup_header_t h;
+
+  MA(lookup_filename, strlen(output_basename) + 32);
+
+  i = 0;
+  table_number = 0;
+  while(i < n_seq) {
+    sprintf(lookup_filename,"%s.lt.%d",output_basename,table_number);
+    init_lookup_header(&h, wordsize);
+    h.table_index = table_number;
+    n = build_sparsetable(&h, &keys, &bloom, &lookup_data, i, binfile,
+			  qualfile);
+    logmsg(MSG_INFO,"Writing sparse lookup table %d spanning sequences "
+	   "%u - %u (%u words, %u Bloom filter blocks)\n", table_number, i, 
+	   i + n, h.n_keys, h.bloom_blocks);
+    write_sparsetable(lookup_filename, &h, keys, bloom, lookup_data);
+    add_to_manifest(lookup_filename, 0);
+    if (fine_wordsize) {
+      strcat(lookup_filename, ".fine");
+      fine_write_table(&h, lookup_filename);
+    }
+    free(keys);
+    free(bloom);
+    free(lookup_data);
+    i += n + 1;
+    table_number++;
+  }
+
+  free(lookup_filename);
+}
+
+/* --stats support. The query side of the predicted scan cost assumes that
+   scan_sequences is run with every sequence of the database as a query,
+   once per strand. query_words[w] holds how many times word w occurs in
+   those queries, counting both strands, with the same quality filtering
+   as the lookup tables. */
+static FILE *stats_file = NULL;
+static uint *query_words = NULL;
+static double query_total = 0.0;
+static int stats_tables = 0;
+static double stats_postings = 0.0, stats_bytes = 0.0;
+static double stats_touched = 0.0, stats_sweeps = 0.0;
+
+static uint reverse_complement_word(uint word) {
+  uint rc;
+  int i;
+
+  rc = 0;
+  for(i=0;i<wordsize;i++) {
+    rc = (rc << 2) | (3 - (word & 0x3));
+    word >>= 2;
+  }
+  return rc;
+}
+
+static void word_string(uint word, char *s) {
+  int i;
+
+  for(i=wordsize-1;i>=0;i--) {
+    s[i] = "ACGT"[word & 0x3];
+    word >>= 2;
+  }
+  s[wordsize] = '\0';
+}
+
+static int compare_desc(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x < y) - (x > y);
+}
+
+/* Share of the sum of <v> (sorted in decreasing order) held by its largest
+   <fraction> of entries, at least one entry */
+static double top_share(double *v, uint n, double sum, double fraction) {
+  uint i, top;
+  double s;
+
+  if (n == 0 || sum <= 0.0) return 0.0;
+  top = (uint) ceil(n*fraction);
+  s = 0.0;
+  for(i=0;i<top && i<n;i++) s += v[i];
+  return s/sum;
+}
+
+static void count_query_words(FILE *binfile, FILE *qualfile) {
+  uint n_words, seq_id, word, skipped;
+  int length, seqsize;
+  uchar *seq, *qual;
+  lookupmeta_t *count;
+
+  n_words = 0x1 << (wordsize*2);
+  CA(count, n_words, sizeof(lookupmeta_t));
+  MA(query_words, sizeof(uint)*n_words);
+
+  seq = qual = NULL;
+  seqsize = 0;
+  skipped = 0;
+  fseek(binfile, seqmeta[0].seqbin_pos, SEEK_SET);
+  for(seq_id=0;seq_id<n_seq;seq_id++) {
+    length = seqmeta[seq_id].seq_length;
+    if (seqsize < length) {
+      seqsize = length;
+      RA(seq, seqsize, sizeof(uchar));
+      RA(qual, seqsize, sizeof(uchar));
+    }
+    fread(seq, sizeof(uchar), length, binfile);
+    read_quality(qualfile, seq_id, qual, length);
+    query_total += index_sequence(seq, qualfile ? qual : NULL, length, 
+				  seq_id, 0, n_words, count, NULL, NULL,
+				  &skipped);
+  }
+  /* The reverse strand of a query contributes the reverse complement of
+     each of its forward words */
+  for(word=0;word<n_words;word++) {
+    query_words[word] = count[word].n_words + 
+      count[reverse_complement_word(word)].n_words;
+  }
+  query_total *= 2;
+
+  free(count);
+  free(seq);
+  free(qual);
+}
+
+static void open_stats(void) {
+
+  if (strcmp(stats_filename, "-") == 0) {
+    stats_file = stdout;
+  } else {
+    stats_file = fopen(stats_filename, "w");
+    if (stats_file == NULL) {
+      logmsg(MSG_FATAL,"! Could not open stats file %s: %s\n", 
+	     stats_filename, strerror(errno));
+    }
+  }
+  fprintf(stats_file,"{\n  \"database\": \"%s\",\n  \"n_seq\": %u,\n"
+	  "  \"wordsize\": %u,\n  \"memsize_mb\": %d,\n"
+	  "  \"partition\": \"%s\",\n  \"min_quality\": %d,\n"
+	  "  \"forward_only\": %d,\n  \"query_words\": %.0f,\n"
+	  "  \"tables\": [", database_basename, n_seq, wordsize, mem_coresize,
+	  partition_words ? "words" : "sequences", min_quality, forward_only,
+	  query_total);
+}
+
+/* Writes the JSON record of one lookup table. <lookup_meta> is indexed by
+   word - h->word_start, and must hold the posting counts after censoring. 
+   The predicted cost is that of find_wordmatches(): each posting of a word
+   is visited once per query occurrence of the word to count hits per 
+   target, and once more to collect them, while hits_byseq is swept twice
+   for every query strand. */
+static void write_table_stats(lookup_header_t *h, uchar *lookup_filename,
+			      lookupmeta_t *lookup_meta) {
+  uint range, w, n_used, i, j, top_words[10];
+  int n_top, bucket, max_bucket;
+  double *counts, *costs, postings, touched, sweeps, cost_sum, bytes;
+  double hist_words[33], hist_postings[33], censored;
+  int n_censor;
+  char s[33];
+
+  range = h->word_end - h->word_start;
+  MA(counts, sizeof(double)*range);
+  MA(costs, sizeof(double)*range);
+  for(i=0;i<33;i++) hist_words[i] = hist_postings[i] = 0.0;
+
+  n_used = 0;
+  n_top = 0;
+  max_bucket = 0;
+  postings = touched = 0.0;
+  for(w=0;w<range;w++) {
+    if (lookup_meta[w].n_words == 0) continue;
+    counts[n_used] = lookup_meta[w].n_words;
+    costs[n_used] = counts[n_used]*query_words[w + h->word_start];
+    postings += counts[n_used];
+    touched += costs[n_used];
+    n_used++;
+
+    for(bucket=0;(lookup_meta[w].n_words >> (bucket+1)) > 0;bucket++);
+    hist_words[bucket] += 1.0;
+    hist_postings[bucket] += lookup_meta[w].n_words;
+    if (bucket > max_bucket) max_bucket = bucket;
+
+    /* Keep the ten heaviest words, heaviest first */
+    for(i=n_top;i>0;i--) {
+      if (lookup_meta[top_words[i-1] - h->word_start].n_words >= 
+	  lookup_meta[w].n_words) break;
+      if (i < 10) top_words[i] = top_words[i-1];
+    }
+    if (i < 10) {
+      top_words[i] = w + h->word_start;
+      if (n_top < 10) n_top++;
+    }
+  }
+  cost_sum = touched;
+  touched *= 2;
+  sweeps = 2.0*2.0*n_seq*(double) (h->seq_end - h->seq_start + 1);
+  qsort(counts, n_used, sizeof(double), compare_desc);
+  qsort(costs, n_used, sizeof(double), compare_desc);
+
+  n_censor = 0;
+  censored = 0.0;
+  for(i=0;i<n_censored;i++) {
+    if (censored_list[i].word < h->word_start || 
+	censored_list[i].word >= h->word_end) continue;
+    n_censor++;
+    censored += censored_list[i].n_words;
+  }
+
+  bytes = lookup_header_size(h) + (double) range*sizeof(lookupmeta_t) +
+    postings*sizeof(word_t);
+  fprintf(stats_file,"%s\n    {\n      \"index\": %u,\n"
+	  "      \"file\": \"%s\",\n"
+	  "      \"seq_start\": %u,\n      \"seq_end\": %u,\n"
+	  "      \"word_start\": %u,\n      \"word_end\": %u,\n"
+	  "      \"postings\": %.0f,\n      \"words_used\": %u,\n"
+	  "      \"censored_words\": %d,\n      \"censored_postings\": %.0f,\n"
+	  "      \"bytes\": {\"header\": %u, \"metadata\": %.0f, "
+	  "\"postings\": %.0f, \"total\": %.0f},\n",
+	  stats_tables ? "," : "", h->table_index, lookup_filename,
+	  h->seq_start, h->seq_end, h->word_start, h->word_end, postings,
+	  n_used, n_censor, censored, lookup_header_size(h), 
+	  (double) range*sizeof(lookupmeta_t), postings*sizeof(word_t), bytes);
+
+  fprintf(stats_file,"      \"posting_histogram\": [");
+  for(bucket=0, j=0;bucket<=max_bucket && n_used > 0;bucket++) {
+    if (hist_words[bucket] == 0.0) continue;
+    fprintf(stats_file,"%s\n        {\"min\": %u, \"max\": %u, "
+	    "\"words\": %.0f, \"postings\": %.0f}", j++ ? "," : "",
+	    1u << bucket, (uint) ((2ull << bucket) - 1), hist_words[bucket],
+	    hist_postings[bucket]);
+  }
+  fprintf(stats_file,"\n      ],\n      \"heaviest_words\": [");
+  for(i=0;i<n_top;i++) {
+    word_string(top_words[i], s);
+    fprintf(stats_file,"%s\n        {\"word\": \"%s\", \"postings\": %d, "
+	    "\"query_occurrences\": %u}", i ? "," : "", s,
+	    lookup_meta[top_words[i] - h->word_start].n_words,
+	    query_words[top_words[i]]);
+  }
+  fprintf(stats_file,"\n      ],\n      \"postings_share\": {"
+	  "\"top_0.1pct_words\": %.4f, \"top_1pct_words\": %.4f, "
+	  "\"top_10pct_words\": %.4f},\n",
+	  top_share(counts, n_used, postings, 0.001),
+	  top_share(counts, n_used, postings, 0.01),
+	  top_share(counts, n_used, postings, 0.1));
+  fprintf(stats_file,"      \"predicted_scan\": {\"word_hits\": %.0f, "
+	  "\"postings_touched\": %.0f, \"hits_byseq_visits\": %.0f, "
+	  "\"top_1pct_words_cost_share\": %.4f}\n    }",
+	  cost_sum, touched, sweeps, top_share(costs, n_used, cost_sum, 0.01));
+  fflush(stats_file);
+
+  stats_tables++;
+  stats_postings += postings;
+  stats_bytes += bytes;
+  stats_touched += touched;
+  stats_sweeps += sweeps;
+  free(counts);
+  free(costs);
+}
+
+static void close_stats(void) {
+
+  fprintf(stats_file,"\n  ],\n  \"totals\": {\"tables\": %d, "
+	  "\"postings\": %.0f, \"bytes\": %.0f, \"postings_touched\": %.0f, "
+	  "\"hits_byseq_visits\": %.0f}\n}\n", stats_tables, stats_postings,
+	  stats_bytes, stats_touched, stats_sweeps);
+  if (stats_file != stdout) fclose(stats_file);
+  stats_file = NULL;
+}
+
+/* Alternative to create_lookup_tables(): every table covers all sequences,
+   but only a contiguous slice of the word space, sized so that the table
+   is not much larger than mem_coresize. Word counts (and so censoring) are
+   computed over the whole database in a first pass, then each slice is 
+   filled by another pass over the sequence file. */
+static void create_wordrange_tables(FILE *binfile, FILE *qualfile) {
+  uint n_words, word, limit, sum;
+  int table_number;
+  uchar *lookup_filename;
+  uint total, censored, skipped;
+  lookupmeta_t *lookup_meta;
+  word_t *lookup_data;
+  int *fill;
+  lookup_header_t h;
+
+  n_words = 0x1 << (wordsize*2);
+  limit = (mem_coresize*1024*1024)/sizeof(word_t);
+
+  CA(lookup_meta, n_words, sizeof(lookupmeta_t));
+  MA(fill, sizeof(int)*n_words);
+  MA(lookup_filename, strlen(output_basename) + 32);
+
+  init_lookup_header(&h, wordsize);
+  h.seq_start = 0;
+  h.seq_end = n_seq - 1;
+  skipped = 0;
+  total = index_database(&h, lookup_meta, NULL, NULL, binfile, qualfile,
+			 &skipped);
+  if (qualfile) {
+    logmsg(MSG_INFO,"Left out %u words containing bases below quality %d "
+	   "(%u words kept)\n",skipped, min_quality, total);
+  }
+  censored = censor_words(lookup_meta, total);
+  total -= censored;
+
+  word = 0;
+  table_number = 0;
+  while(word < n_words) {
+    h.word_start = word;
+    sum = 0;
+    while(word < n_words && 
+	  (sum == 0 || sum + lookup_meta[word].n_words <= limit)) {
+      sum += lookup_meta[word].n_words;
+      word++;
+    }
+    h.word_end = word;
+    h.table_index = table_number;
+    h.table_size = sum;
+
+    sprintf(lookup_filename,"%s.lt.%d",output_basename,table_number);
+    if (stats_file) {
+      write_table_stats(&h, lookup_filename, lookup_meta + h.word_start);
+    }
+    if (!stats_only) {
+      MA(lookup_data, sizeof(word_t)*(sum > 0 ? sum : 1));
+      compute_offsets(&h, lookup_meta + h.word_start, fill);
+      index_database(&h, lookup_meta + h.word_start, fill, lookup_data, 
+		     binfile, qualfile, &skipped);
+
+      logmsg(MSG_INFO,"Writing lookup table %d spanning words %X - %X "
+	     "(%u postings)\n", table_number, h.word_start, h.word_end - 1,
+	     sum);
+      write_lookuptable(lookup_filename, &h, lookup_meta + h.word_start,
+			lookup_data);
+      add_to_manifest(lookup_filename, 0);
+      free(lookup_data);
+    }
+    table_number++;
+  }
+
+  free(fill);
+  free(lookup_meta);
+  free(lookup_filename);
+}
+
+/* Sets [part_start, part_end) to the sequences of --part, or to the whole
+   database. Parts hold about the same number of bases and only start at
+   even sequence ids, so that a sequence and the reverse complement that 
+   format_seqdata puts after it stay together. */
+static void select_part(void) {
+  double total, sum;
+  uint seq_id;
+
+  part_start = 0;
+  part_end = n_seq;
+  if (n_parts == 0) return;
+
+  total = 0.0;
+  for(seq_id=0;seq_id<n_seq;seq_id++) total += seqmeta[seq_id].seq_length;
+
+  part_start = part_end = n_seq;
+  sum = 0.0;
+  for(seq_id=0;seq_id<n_seq;seq_id++) {
+    if (!(seq_id & 0x1)) {
+      if (part_start == n_seq && sum >= total*(part_index - 1)/n_parts) 
+	part_start = seq_id;
+      if (part_end == n_seq && sum >= total*part_index/n_parts &&
+	  part_index < n_parts) 
+	part_end = seq_id;
+    }
+    sum += seqmeta[seq_id].seq_length;
+  }
+  logmsg(MSG_INFO,"Part %d of %d: sequences %u - %u\n", part_index, n_parts,
+	 part_start, part_end - 1);
+  if (part_start >= part_end) {
+    logmsg(MSG_WARNING,"Part %d of %d holds no sequences\n", part_index,
+	   n_parts);
+  }
+}
+
+/* Parts are only listed once merged, by merge_lookup, and --stats-only
+   writes no tables */
+static void write_database_manifest(void) {
+  uchar *filename;
+
+  if (n_parts || stats_only) return;
+  MA(filename, strlen(output_basename) + 16);
+  sprintf(filename, "%s.manifest", output_basename);
+  write_manifest(filename, manifest, n_manifest);
+  free(filename);
+}
+
+/* Reads <basename>.manifest for --delta: new tables start at the first
+   sequence not covered by any listed table and take their word size and
+   censored words from those tables. Returns the first table number. */
+static int load_delta_base(void) {
+  uchar *filename;
+  FILE *f;
+  lookup_header_t h;
+  lookupmeta_t *meta;
+  uint w, range;
+  int i, next_index;
+
+  MA(filename, strlen(output_basename) + 16);
+  sprintf(filename, "%s.manifest", output_basename);
+  n_manifest = read_manifest(filename, &manifest);
+  free(filename);
+  if (n_manifest == 0) {
+    logmsg(MSG_FATAL,"! --delta needs the tables already built, but the "
+	   "manifest lists none\n");
+  }
+
+  part_start = 0;
+  next_index = 0;
+  for(i=0;i<n_manifest;i++) {
+    f = fopen(manifest[i].filename, "r");
+    if (f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening lookup file %s (%s)\n",
+	     manifest[i].filename, strerror(errno));
+    }
+    read_lookup_header(f, manifest[i].filename, &h);
+    if (h.flags != 0) {
+      logmsg(MSG_FATAL,"! %s is a sparse table, --delta only adds to dense "
+	     "tables\n", manifest[i].filename);
+    }
+    if (i == 0) {
+      wordsize = h.wordsize;
+      CA(delta_censored, 0x1 << (wordsize*2), sizeof(uchar));
+    } else if (h.wordsize != wordsize) {
+      logmsg(MSG_FATAL,"! Tables of the manifest have different word "
+	     "sizes\n");
+    }
+    range = h.word_end - h.word_start;
+    MA(meta, sizeof(lookupmeta_t)*range);
+    fread(meta, sizeof(lookupmeta_t), range, f);
+    for(w=0;w<range;w++) {
+      if (meta[w].start_pos == CENSORED_WORD) 
+	delta_censored[w + h.word_start] = 1;
+    }
+    free(meta);
+    fclose(f);
+    if (h.seq_end + 1 > part_start) part_start = h.seq_end + 1;
+    if (h.table_index + 1 > next_index) next_index = h.table_index + 1;
+  }
+  part_end = n_seq;
+
+  logmsg(MSG_INFO,"Adding delta tables for sequences %u - %u\n", part_start,
+	 part_end - 1);
+  return next_index;
 }
 
 static void create_lookup_tables(void) {
   uint n_words;
   int i,j, table_number, l;
   uchar *lookup_filename;
-  uint n, total;
+  uint n;
   lookupmeta_t *lookup_meta;
   word_t *lookup_data;
-  FILE *lf;
-  FILE *indfile, *binfile;
+  FILE *indfile, *binfile, *qualfile;
+  lookup_header_t h;
 
   /* n_seq is read out of index file header */
-  open_databasefiles(&indfile, &binfile);
+  open_databasefiles(&indfile, &binfile, &qualfile);
+  select_part();
+
+  if (quality_report) {
+    report_quality_savings(qualfile);
+    return;
+  }
+
+  if (stats_filename) {
+    count_query_words(binfile, qualfile);
+    open_stats();
+  }
+
+  if (sparse_index) {
+    create_sparse_tables(binfile, qualfile);
+    write_database_manifest();
+    return;
+  }
+
+  if (partition_words) {
+    create_wordrange_tables(binfile, qualfile);
+    if (stats_file) close_stats();
+    write_database_manifest();
+    return;
+  }
+
+  table_number = 0;
+  if (delta_mode) table_number = load_delta_base();
 
   n_words = 0x1 << (wordsize*2);
 
   MA(lookup_meta, sizeof(lookupmeta_t)*n_words);
-  MA(lookup_data, sizeof(word_t *)*n_words);
   l = strlen(output_basename) + 32;
   MA(lookup_filename, l);
 
-  i = 0;
-  table_number = 0;
-  while(i < n_seq) {
+  i = part_start;
+  while(i < part_end) {
     for(j=0;j<n_words;j++) {
       lookup_meta[j].n_words = 0;
       lookup_meta[j].start_pos = 0;
     }
     sprintf(lookup_filename,"%s.lt.%d",output_basename,table_number);
-    n = build_lookuptable(lookup_meta, &lookup_data, &total, i, binfile);
-    lf = fopen(lookup_filename, "w");
-    if (lf == NULL) {
-      logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
-	     lookup_filename, strerror(errno));
-    }
-    logmsg(MSG_INFO,"Writing lookup table %d spanning sequences %u - %u\n",
-	   table_number, i, i + n);
-    write_header(lf, i, i + n, total, table_number);
-    fwrite(lookup_meta, sizeof(lookupmeta_t), n_words, lf);
-    fwrite(lookup_data, sizeof(word_t), total, lf);
-    free(lookup_data);
-    fclose(lf);
+    init_lookup_header(&h, wordsize);
+    h.table_index = table_number;
+    n = build_lookuptable(&h, lookup_meta, &lookup_data, i, binfile,
+			  qualfile);
+    if (stats_file) {
+      write_table_stats(&h, lookup_filename, lookup_meta);
+    }
+    if (!stats_only) {
+      logmsg(MSG_INFO,"Writing lookup table %d spanning sequences %u - %u\n",
+	     table_number, i, i + n);
+      write_lookuptable(lookup_filename, &h, lookup_meta, lookup_data);
+      add_to_manifest(lookup_filename, delta_mode);
+      free(lookup_data);
+    }
     i += n + 1;
     table_number++;
   }
 
+  if (stats_file) close_stats();
+  write_database_manifest();
   free(lookup_meta);
   free(lookup_filename);
 }
@@ -13,13 +13,13 @@ int verbosity_level = 0;
 
 #define ALLOC_STEP (128)
 
-inline int white_space(uchar c) {
+static inline int white_space(uchar c) {
 
   if (c == '\n' || c == '\t' || c == '\r' || c == ' ') return 1;
   return 0;
 }
 
-inline int nucleotide(uchar c) {
+static inline int nucleotide(uchar c) {
   
   /* Lower case letter to simply if statement */
   if (c<97) c+=32;
@@ -101,12 +101,78 @@ static uint read_fullline(uchar **rline, uint *space, FILE *f) {
   return length;
 }
 
-static uint format_input(uchar *input_seqfile, FILE *indfile, FILE *strfile,
-			 FILE *binfile) {
-  FILE *sf;
+/* read_quality()
+   Input:  open FASTA quality file, positioned so that <qline> holds the
+           header of the next record, and the name of the sequence that
+           record is expected to belong to.
+   Output: Number of quality values stored in <qual>. <qline> is left holding
+           the header of the following record (or is empty at end of file).
+
+   Purpose: The quality file is read in lockstep with the sequence file, so
+   its records must be in the same order (as written by phred/phrap). Values
+   are clamped to a byte, which is plenty for phred scores. */
+static uint read_quality(FILE *qf, uchar *qualfile, uchar *seqname,
+			 uchar **qline, uint *qline_allocsize, uint *qline_length,
+			 uchar **qual, uint *qualsize) {
+  uint name_start, name_end, j, k, n;
+  int score;
+
+  if (*qline_length == 0 || (*qline)[0] != '>') {
+    logmsg(MSG_FATAL,"Quality file %s has no record for sequence %s\n",
+	   qualfile, seqname);
+  }
+
+  name_start = 1;
+  while(name_start < *qline_length && white_space((*qline)[name_start]))
+    name_start++;
+  name_end = name_start + 1;
+  while(name_end < *qline_length && !white_space((*qline)[name_end]))
+    name_end++;
+  (*qline)[name_end] = 0;
+  if (strcmp(*qline + name_start, seqname) != 0) {
+    logmsg(MSG_FATAL,"Quality file %s is out of order: expected record for %s,"
+	   " found %s\n",qualfile, seqname, *qline + name_start);
+  }
+
+  n = 0;
+  *qline_length = read_fullline(qline, qline_allocsize, qf);
+  while(*qline_length>0 && (*qline)[0]!='>') {
+    j = 0;
+    while(j<*qline_length) {
+      while(j<*qline_length && white_space((*qline)[j])) j++;
+      if (j == *qline_length) break;
+      k = j;
+      score = 0;
+      while(k<*qline_length && (*qline)[k]>='0' && (*qline)[k]<='9') {
+	score = score*10 + (*qline)[k] - '0';
+	k++;
+      }
+      if (k == j || (k<*qline_length && !white_space((*qline)[k]))) {
+	logmsg(MSG_FATAL,"Quality file %s: bad quality value in record %s\n",
+	       qualfile, seqname);
+      }
+      if (n >= *qualsize) {
+	*qualsize += ALLOC_STEP;
+	RA(*qual, *qualsize, sizeof(uchar));
+      }
+      (*qual)[n++] = score > 255 ? 255 : score;
+      j = k;
+    }
+    *qline_length = read_fullline(qline, qline_allocsize, qf);
+  }
+
+  return n;
+}
+
+static uint format_input(uchar *input_seqfile, uchar *input_qualfile,
+			 FILE *indfile, FILE *strfile, FILE *binfile,
+			 FILE *qualfile) {
+  FILE *sf, *qf;
   uint line_no, input_length, name_start, name_end, i, j;
   uint input_allocsize;
   uchar *inputline;
+  uint qline_length, qline_allocsize, qualsize, n_qual;
+  uchar *qline, *qual;
   seqmeta_t *seqmeta;
   seqmeta_t *seq;
   uchar *sequence, *binseq, *comp;
@@ -135,6 +201,14 @@ static uint format_input(uchar *input_seqfile, FILE *indfile, FILE *strfile,
 
   sf = openfile(input_seqfile, "r", "FASTA sequence file");
 
+  qf = NULL;
+  qline = qual = NULL;
+  qline_length = qline_allocsize = qualsize = 0;
+  if (input_qualfile) {
+    qf = openfile(input_qualfile, "r", "FASTA quality file");
+    qline_length = read_fullline(&qline, &qline_allocsize, qf);
+  }
+
   input_length = read_fullline(&inputline, &input_allocsize, sf);
   line_no = 1;
   seq_id = 0;
@@ -211,6 +285,18 @@ static uint format_input(uchar *input_seqfile, FILE *indfile, FILE *strfile,
     }
     fwrite(binseq, sizeof(uchar), seq_length, binfile);
 
+    /* Quality values are written at the same offsets as the binary sequence
+       so that seqbin_pos indexes both files */
+    if (qf) {
+      n_qual = read_quality(qf, input_qualfile, seq_names[seq_id], &qline,
+			    &qline_allocsize, &qline_length, &qual, &qualsize);
+      if (n_qual != seq_length) {
+	logmsg(MSG_FATAL,"Sequence %s has %d bases but %d quality values\n",
+	       seq_names[seq_id], seq_length, n_qual);
+      }
+      fwrite(qual, sizeof(uchar), seq_length, qualfile);
+    }
+
     binfile_ptr += seq_length;
     strfile_ptr += seq_length;
     seq_id++;
@@ -279,6 +365,11 @@ static uint format_input(uchar *input_seqfile, FILE *indfile, FILE *strfile,
   }
 
   fclose(sf);
+  if (qf) {
+    fclose(qf);
+    free(qline);
+    free(qual);
+  }
 
   free(inputline);
   free(binseq);
@@ -367,6 +458,10 @@ static void usage(char *program_name) {
 "Options:									  \n"
 "--seqfile=<filename> (-s) (required)						  \n"
 "    FASTA format input file to be translated/formatted				  \n"
+"--qualfile=<filename> (-q)							  \n"
+"    FASTA format phred quality file, with records in the same order as the	  \n"
+"    sequence file. Quality values are written to <basename>.qbin, which is	  \n"
+"    used by the --min-quality options of format_lookup and scan_sequences.	  \n"
 "--basename=<string> (-o)							  \n"
 "    String to use as prefix for output files created. Uses input filename by 	  \n"
 "    default.									  \n"
@@ -379,18 +474,20 @@ static void usage(char *program_name) {
 ,program_name);								  
 										  
 }										  
-static void parse_arguments(uchar **seqfilename, int argc, char *argv[]) {	  
+static void parse_arguments(uchar **seqfilename, uchar **qualfilename,
+			    int argc, char *argv[]) {	  
   int option_index, commandline_error, rval;					  
   struct option longopts[] = {
     { "seqfile", 1, NULL, 's'},
+    { "qualfile", 1, NULL, 'q'},
     { "basename", 1, NULL, 'o'},  
     { "verbose", 1, NULL, 'v'},
     { "help", 1, NULL, 'h'},
     { NULL, 0, NULL, 0}
   };
-  char *optstring = "s:v:o:";
+  char *optstring = "s:q:v:o:";
 
-  *seqfilename = output_basename = NULL;
+  *seqfilename = *qualfilename = output_basename = NULL;
   commandline_error = 0;
   while((rval = getopt_long(argc, argv, optstring, longopts, &option_index))
 	!= -1) {
@@ -403,6 +500,9 @@ static void parse_arguments(uchar **seqfilename, int argc, char *argv[]) {
     case 's':
       *seqfilename = strdup(optarg);
       break;
+    case 'q':
+      *qualfilename = strdup(optarg);
+      break;
     case 'v':
       verbosity_level = atoi(optarg);
       break;
@@ -439,14 +539,14 @@ static void parse_arguments(uchar **seqfilename, int argc, char *argv[]) {
 }
 
 int main(int argc, char *argv[]) {
-  uchar *input_seqfile;
+  uchar *input_seqfile, *input_qualfile;
   uchar *temp;
   uint n_seq, x;
   int l;
-  FILE *indfile, *strfile, *binfile;
+  FILE *indfile, *strfile, *binfile, *qualfile;
 
   configure_logmsg(MSG_DEBUG1);
-  parse_arguments(&input_seqfile, argc, argv);
+  parse_arguments(&input_seqfile, &input_qualfile, argc, argv);
   configure_logmsg(verbosity_level);
 
   logmsg(MSG_INFO,"Output basename set to %s\n",output_basename);
@@ -471,11 +571,22 @@ int main(int argc, char *argv[]) {
   binfile = openfile(temp, "w", "sequence binary file");
   x = BINFILE_MAGIC;
   fwrite(&x, sizeof(uint), 1, binfile);
+
+  qualfile = NULL;
+  if (input_qualfile) {
+    strcpy(temp, output_basename);
+    strcat(temp, ".qbin");
+    qualfile = openfile(temp, "w", "sequence quality file");
+    x = QUALFILE_MAGIC;
+    fwrite(&x, sizeof(uint), 1, qualfile);
+  }
   
-  n_seq = format_input(input_seqfile, indfile, strfile, binfile);
+  n_seq = format_input(input_seqfile, input_qualfile, indfile, strfile, 
+		       binfile, qualfile);
   fclose(indfile);
   fclose(strfile);
   fclose(binfile);
+  if (qualfile) fclose(qualfile);
   logmsg(MSG_INFO,"%d sequences formatted\n",n_seq);
 
   return 0;
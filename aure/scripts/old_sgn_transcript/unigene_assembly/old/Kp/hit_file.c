@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kp_types.h"
+#include "log_message.h"
+
+/* ---- This file's types and exports ---- */
+#include "hit_file.h"
+
+void write_hitfile_header(FILE *f, uint n_seq, uint wordsize, 
+			  int alignments) {
+  hitfile_header_t h;
+
+  h.magic = HITFILE_MAGIC;
+  h.record_size = sizeof(hit_record_t);
+  if (alignments) h.record_size += sizeof(hit_alignment_t);
+  h.n_seq = n_seq;
+  h.wordsize = wordsize;
+  fwrite(&h, sizeof(hitfile_header_t), 1, f);
+}
+
+/* Maps a hit file into memory read only and checks its header */
+hitfile_t *open_hitfile(const char *filename) {
+  hitfile_t *hf;
+  struct stat sb;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    logmsg(MSG_FATAL,"! Failed opening hit file %s (%s)\n", filename,
+	   strerror(errno));
+  }
+  if (fstat(fd, &sb) < 0) {
+    logmsg(MSG_FATAL,"! Failed reading hit file %s (%s)\n", filename,
+	   strerror(errno));
+  }
+  if (sb.st_size < sizeof(hitfile_header_t)) {
+    logmsg(MSG_FATAL,"! %s is not a hit file\n", filename);
+  }
+
+  CA(hf, 1, sizeof(hitfile_t));
+  hf->filename = strdup(filename);
+  hf->map_size = sb.st_size;
+  hf->map = mmap(NULL, hf->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (hf->map == MAP_FAILED) {
+    logmsg(MSG_FATAL,"! Failed mapping hit file %s (%s)\n", filename,
+	   strerror(errno));
+  }
+  close(fd);
+
+  hf->header = hf->map;
+  if (hf->header->magic != HITFILE_MAGIC) {
+    logmsg(MSG_FATAL,"! %s is not a hit file\n", filename);
+  }
+  if ((hf->header->record_size != sizeof(hit_record_t) &&
+       hf->header->record_size != 
+       sizeof(hit_record_t) + sizeof(hit_alignment_t)) ||
+      (hf->map_size - sizeof(hitfile_header_t)) % hf->header->record_size) {
+    logmsg(MSG_FATAL,"! Hit file %s has an unknown record size or is "
+	   "truncated\n", filename);
+  }
+  hf->records = (uchar *) hf->map + sizeof(hitfile_header_t);
+  hf->n_records = (hf->map_size - sizeof(hitfile_header_t))/
+    hf->header->record_size;
+  madvise(hf->map, hf->map_size, MADV_SEQUENTIAL);
+
+  return hf;
+}
+
+void close_hitfile(hitfile_t *hf) {
+
+  munmap(hf->map, hf->map_size);
+  free(hf->filename);
+  free(hf);
+}
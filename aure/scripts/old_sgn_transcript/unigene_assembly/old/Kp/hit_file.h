@@ -0,0 +1,66 @@
+#ifndef _HIT_FILE_H
+#define _HIT_FILE_H
+
+/* Binary hit output of scan_sequences --binary. The file starts with a
+   hitfile_header_t and goes on with fixed size hit_record_t records, one
+   per reported hit, in the order the text output would list them. The
+   fields are those of a line of text output; score - discount, the fifth
+   column, is not stored. With scan_sequences --verify each record is
+   followed by the hit_alignment_t of its banded alignment, and the header's
+   record_size covers both. Files are read by mapping them into memory with
+   open_hitfile(), so that the records can be used in place through 
+   hitfile_record() and hitfile_alignment(). */
+typedef struct {
+  uint magic;         /* HITFILE_MAGIC */
+  uint record_size;   /* sizeof(hit_record_t), plus sizeof(hit_alignment_t)
+			 if the hits were verified */
+  uint n_seq;         /* sequences in the database scanned */
+  uint wordsize;
+} hitfile_header_t;
+
+typedef struct {
+  uint query;
+  uint target;
+  int score;
+  int discount;
+  int q_length;
+  int s_length;
+  int start, end;     /* on the query, reverse complemented if strand */
+  int s_start, s_end; /* on the target */
+  uint strand;        /* 1 for the reverse complement of the query */
+} hit_record_t;
+
+/* Banded alignment of a verified hit. Coordinates are of the first and 
+   last aligned bases, with the query reverse complemented if strand. */
+typedef struct {
+  int matches;
+  int length;         /* alignment columns, gaps included */
+  int q_start, q_end;
+  int s_start, s_end;
+} hit_alignment_t;
+
+typedef struct {
+  char *filename;
+  void *map;
+  size_t map_size;
+  hitfile_header_t *header;
+  uchar *records;
+  size_t n_records;
+} hitfile_t;
+
+void write_hitfile_header(FILE *f, uint n_seq, uint wordsize, 
+			  int alignments);
+hitfile_t *open_hitfile(const char *filename);
+void close_hitfile(hitfile_t *hf);
+
+static inline hit_record_t *hitfile_record(hitfile_t *hf, size_t i) {
+  return (hit_record_t *) (hf->records + i*hf->header->record_size);
+}
+
+/* NULL if the hits of the file were not verified */
+static inline hit_alignment_t *hitfile_alignment(hitfile_t *hf, size_t i) {
+  if (hf->header->record_size == sizeof(hit_record_t)) return NULL;
+  return (hit_alignment_t *) (hitfile_record(hf, i) + 1);
+}
+
+#endif
@@ -54,6 +54,11 @@ if ((p) == NULL) {    \
 #define INDFILE_MAGIC (0x10001217)
 #define STRFILE_MAGIC (0x10001218)
 #define BINFILE_MAGIC (0x10001219)
+#define QUALFILE_MAGIC (0x1000121A)
 #define LOOKUP_MAGIC  (0x100013A1)
+#define LOOKUP2_MAGIC (0x100013A2)
+#define PARTIAL_MAGIC (0x100013B1)
+#define HITFILE_MAGIC (0x100013C1)
+#define CHECKPOINT_MAGIC (0x100013D1)
 
 #endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "kp_types.h"
+#include "log_message.h"
+
+/* ---- This file's types and exports ---- */
+#include "lookup_table.h"
+
+/* Sets up a header covering the whole word space, with no sequences */
+void init_lookup_header(lookup_header_t *h, uint wordsize) {
+
+  h->wordsize = wordsize;
+  h->seq_start = 0;
+  h->seq_end = 0;
+  h->table_index = 0;
+  h->table_size = 0;
+  h->word_start = 0;
+  h->word_end = 0x1 << (wordsize*2);
+  h->flags = 0;
+  h->n_keys = 0;
+  h->bloom_blocks = 0;
+  h->bloom_probes = 0;
+}
+
+int lookup_header_fullrange(lookup_header_t *h) {
+
+  return (h->word_start == 0 && h->word_end == (0x1 << (h->wordsize*2)) &&
+	  h->flags == 0);
+}
+
+/* Size in bytes of the header as written to the file. Postings of the first
+   word start at lookup_header_size() + n_words*sizeof(lookupmeta_t). */
+uint lookup_header_size(lookup_header_t *h) {
+
+  if (lookup_header_fullrange(h)) return 6*sizeof(uint);
+  if (h->flags & LOOKUP_SPARSE) return 12*sizeof(uint);
+  return 9*sizeof(uint);
+}
+
+void write_lookup_header(FILE *f, lookup_header_t *h) {
+  uint x;
+
+  x = lookup_header_fullrange(h) ? LOOKUP_MAGIC : LOOKUP2_MAGIC;
+  fwrite(&x, sizeof(uint), 1, f);
+
+  fwrite(&h->wordsize, sizeof(uint), 1, f);
+  fwrite(&h->seq_start, sizeof(uint), 1, f);
+  fwrite(&h->seq_end, sizeof(uint), 1, f);
+  fwrite(&h->table_index, sizeof(int), 1, f);
+  fwrite(&h->table_size, sizeof(uint), 1, f);
+  if (x == LOOKUP2_MAGIC) {
+    fwrite(&h->word_start, sizeof(uint), 1, f);
+    fwrite(&h->word_end, sizeof(uint), 1, f);
+    fwrite(&h->flags, sizeof(uint), 1, f);
+  }
+  if (h->flags & LOOKUP_SPARSE) {
+    fwrite(&h->n_keys, sizeof(uint), 1, f);
+    fwrite(&h->bloom_blocks, sizeof(uint), 1, f);
+    fwrite(&h->bloom_probes, sizeof(uint), 1, f);
+  }
+}
+
+/* Reads and sanity checks a lookup table header. Any problem is fatal. */
+void read_lookup_header(FILE *f, uchar *filename, lookup_header_t *h) {
+  uint x;
+
+  if (fread(&x, sizeof(uint), 1, f) != 1 || 
+      (x != LOOKUP_MAGIC && x != LOOKUP2_MAGIC)) {
+    logmsg(MSG_FATAL,"! Lookup file %s does not appear to be properly "
+	   "formatted\n", filename);
+  }
+
+  fread(&h->wordsize, sizeof(uint), 1, f);
+  if (h->wordsize < 2 || h->wordsize > 15) {
+    logmsg(MSG_FATAL,"! Lookup file %s does not appear to be properly "
+	   "formatted\n", filename);
+  }
+  init_lookup_header(h, h->wordsize);
+  fread(&h->seq_start, sizeof(uint), 1, f);
+  fread(&h->seq_end, sizeof(uint), 1, f);
+  fread(&h->table_index, sizeof(int), 1, f);
+  if (fread(&h->table_size, sizeof(uint), 1, f) != 1) {
+    logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", filename);
+  }
+  if (x == LOOKUP2_MAGIC) {
+    fread(&h->word_start, sizeof(uint), 1, f);
+    fread(&h->word_end, sizeof(uint), 1, f);
+    if (fread(&h->flags, sizeof(uint), 1, f) != 1) {
+      logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", filename);
+    }
+    if (h->word_start >= h->word_end || 
+	h->word_end > (0x1 << (h->wordsize*2))) {
+      logmsg(MSG_FATAL,"! Lookup file %s has an invalid word range\n",
+	     filename);
+    }
+    if ((h->flags & ~(LOOKUP_SPARSE | LOOKUP_FINE)) ||
+	(h->flags & LOOKUP_SPARSE && h->flags & LOOKUP_FINE)) {
+      logmsg(MSG_FATAL,"! Lookup file %s uses unknown features (flags %X)\n",
+	     filename, h->flags);
+    }
+  }
+  if (h->flags & LOOKUP_SPARSE) {
+    fread(&h->n_keys, sizeof(uint), 1, f);
+    fread(&h->bloom_blocks, sizeof(uint), 1, f);
+    if (fread(&h->bloom_probes, sizeof(uint), 1, f) != 1) {
+      logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", filename);
+    }
+    if (h->bloom_blocks > 0 && 
+	(h->bloom_probes < 1 || h->bloom_probes > BLOOM_BLOCK_BITS)) {
+      logmsg(MSG_FATAL,"! Lookup file %s has an invalid Bloom filter\n",
+	     filename);
+    }
+  }
+}
+
+/* Reads a manifest into *entries and returns the number of tables. A 
+   missing or malformed manifest is fatal. */
+int read_manifest(uchar *filename, manifest_entry_t **entries) {
+  FILE *f;
+  char line[4096], kind[16], name[4096];
+  manifest_entry_t *e;
+  int n;
+
+  f = fopen((char *) filename, "r");
+  if (f == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening manifest %s (%s)\n", filename,
+	   strerror(errno));
+  }
+  e = NULL;
+  n = 0;
+  while(fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "%15s %4095s", kind, name) != 2 ||
+	(strcmp(kind, "base") != 0 && strcmp(kind, "delta") != 0)) {
+      logmsg(MSG_FATAL,"! Manifest %s is malformed at: %s", filename, line);
+    }
+    PUSH(e, n, sizeof(manifest_entry_t));
+    e[n].filename = (uchar *) strdup(name);
+    e[n].delta = (strcmp(kind, "delta") == 0);
+    n++;
+  }
+  fclose(f);
+
+  *entries = e;
+  return n;
+}
+
+/* Writes a manifest under a temporary name and renames it into place, so 
+   that a concurrent reader sees either the old or the new list */
+void write_manifest(uchar *filename, manifest_entry_t *entries, int n) {
+  FILE *f;
+  char *temp;
+  int i;
+
+  MA(temp, strlen((char *) filename) + 8);
+  sprintf(temp, "%s.tmp", filename);
+  f = fopen(temp, "w");
+  if (f == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n", temp,
+	   strerror(errno));
+  }
+  fprintf(f, "# lookup tables of a formatted sequence database\n");
+  for(i=0;i<n;i++) {
+    fprintf(f, "%s %s\n", entries[i].delta ? "delta" : "base",
+	    entries[i].filename);
+  }
+  if (fclose(f) != 0 || rename(temp, (char *) filename) != 0) {
+    logmsg(MSG_FATAL,"! Failed writing manifest %s (%s)\n", filename,
+	   strerror(errno));
+  }
+  free(temp);
+}
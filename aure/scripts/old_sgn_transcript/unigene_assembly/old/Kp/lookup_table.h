@@ -0,0 +1,130 @@
+#ifndef _LOOKUP_TABLE_H
+#define _LOOKUP_TABLE_H
+
+/* Header of a lookup table file written by format_lookup. Tables covering
+   every word of a range of sequences are written with the original
+   LOOKUP_MAGIC header; tables covering only a slice [word_start, word_end) 
+   of the word space use LOOKUP2_MAGIC, which adds the word range and a
+   flags field. In both cases the header is followed by the lookupmeta_t 
+   records of the words covered and then by the word_t postings. 
+
+   Sparse tables (LOOKUP_SPARSE in flags) are meant for word sizes where a
+   lookupmeta_t per possible word would not fit in memory. The header
+   goes on with n_keys, bloom_blocks and bloom_probes, and is followed by 
+   the n_keys sparsemeta_t records of the words that have postings, in 
+   increasing word order, then by bloom_blocks blocks of a Bloom filter 
+   over those words and finally by the postings. 
+
+   The fine layer of a layered index (LOOKUP_FINE, format_lookup 
+   --fine-wordsize) is indexed by sequence rather than by word: the header
+   is followed by seq_end - seq_start + 2 uint offsets and then by the 
+   fineword_t words of each sequence of the range, sorted by word and 
+   position, so that the words shared by a query and one candidate target
+   are found by merging two sorted lists. */
+typedef struct {
+  uint wordsize;
+  uint seq_start;
+  uint seq_end;       /* inclusive */
+  int table_index;
+  uint table_size;    /* number of word_t postings */
+  uint word_start;
+  uint word_end;      /* exclusive */
+  uint flags;
+  uint n_keys;        /* sparse tables only */
+  uint bloom_blocks;  /* sparse tables only, 0 if there is no filter */
+  uint bloom_probes;
+} lookup_header_t;
+
+#define LOOKUP_SPARSE 0x1
+#define LOOKUP_FINE   0x2
+
+typedef struct {
+  uint word;
+  int n_words;
+  uint start_pos;
+} sparsemeta_t;
+
+typedef struct {
+  uint word;
+  uint pos;
+} fineword_t;
+
+/* The Bloom filter is split into blocks of one 64 byte cache line. A word
+   selects one block and sets or tests bloom_probes bits inside it, so that
+   a query word absent from the table is usually rejected with a single
+   cache miss. */
+#define BLOOM_BLOCK_UINTS 16
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_UINTS*32)
+
+/* 64 bit finalizer of MurmurHash3. The high half is used to pick a Bloom 
+   block or hash table slot, the low half for the bits within a block. */
+static inline unsigned long long lookup_word_hash(uint word) {
+  unsigned long long h = word;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint *bloom_block(uint *bloom, uint n_blocks,
+				unsigned long long h) {
+  return bloom + BLOOM_BLOCK_UINTS*(uint) (((h >> 32)*n_blocks) >> 32);
+}
+
+static inline void bloom_insert(uint *bloom, uint n_blocks, uint n_probes,
+				uint word) {
+  unsigned long long h;
+  uint *block, g1, g2, b, i;
+
+  h = lookup_word_hash(word);
+  block = bloom_block(bloom, n_blocks, h);
+  g1 = (uint) h;
+  g2 = ((uint) h >> 9) | 1;
+  for(i=0;i<n_probes;i++) {
+    b = (g1 + i*g2) % BLOOM_BLOCK_BITS;
+    block[b >> 5] |= 0x1u << (b & 31);
+  }
+}
+
+static inline int bloom_check(uint *bloom, uint n_blocks, uint n_probes,
+			      uint word) {
+  unsigned long long h;
+  uint *block, g1, g2, b, i;
+
+  h = lookup_word_hash(word);
+  block = bloom_block(bloom, n_blocks, h);
+  g1 = (uint) h;
+  g2 = ((uint) h >> 9) | 1;
+  for(i=0;i<n_probes;i++) {
+    b = (g1 + i*g2) % BLOOM_BLOCK_BITS;
+    if (!(block[b >> 5] & (0x1u << (b & 31)))) return 0;
+  }
+  return 1;
+}
+
+/* start_pos of a word censored for being over-represented. Tables added
+   to a database later (format_lookup --delta) and merge_lookup leave the
+   word out as well. */
+#define CENSORED_WORD 0xFFFFFFFF
+
+/* The tables of a database are listed in <basename>.manifest, one per line
+   as "base <file>" or "delta <file>". Delta tables index sequences appended
+   to the database after the base tables were built; merge_lookup --manifest
+   folds them into the last base table. */
+typedef struct {
+  uchar *filename;
+  int delta;
+} manifest_entry_t;
+
+void init_lookup_header(lookup_header_t *h, uint wordsize);
+int lookup_header_fullrange(lookup_header_t *h);
+uint lookup_header_size(lookup_header_t *h);
+void write_lookup_header(FILE *f, lookup_header_t *h);
+void read_lookup_header(FILE *f, uchar *filename, lookup_header_t *h);
+int read_manifest(uchar *filename, manifest_entry_t **entries);
+void write_manifest(uchar *filename, manifest_entry_t *entries, int n);
+
+#endif
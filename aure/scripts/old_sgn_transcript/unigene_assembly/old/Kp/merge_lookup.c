@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "kp_types.h"
+#include "log_message.h"
+#include "lookup_table.h"
+
+static char *output_filename = NULL;
+static char *manifest_filename = NULL;
+static int verbosity_level = 0;
+static int censor = 1;
+
+typedef struct {
+  char *filename;
+  FILE *f;
+  lookup_header_t h;
+  lookupmeta_t *meta;
+} input_t;
+
+static void usage(char *program_name) {
+
+  fprintf(stderr,"\n\n%s:\n\n"
+"Combines lookup tables built by format_lookup over disjoint ranges of       \n"
+"sequences (for instance with format_lookup --part, on separate hosts) into  \n"
+"one lookup table covering all of them. The posting lists of each word are   \n"
+"concatenated in sequence order, and the offsets recomputed.                 \n"
+"                                                                             \n"
+"Usage: %s [options] <lookup table> [<lookup table> ...]                     \n"
+"                                                                             \n"
+"Options:                                                                     \n"
+"--output=<file> (-o) (required unless --manifest)                            \n"
+"    Name of the merged lookup table. If it is named <database>.lt.N, as      \n"
+"    format_lookup names tables, <database>.manifest is written listing it    \n"
+"    as the base table, so that format_lookup --delta can add to it.          \n"
+"--manifest=<file> (-m)                                                       \n"
+"    Compaction of a database manifest (see format_lookup --delta): fold the  \n"
+"    delta tables it lists into its last base table, which is replaced, then  \n"
+"    rewrite the manifest and remove the deltas. Scans that already opened    \n"
+"    the old tables are not disturbed, so this can run in the background.    \n"
+"    No table is named on the command line. Only the words censored in the   \n"
+"    base stay censored, as in the deltas, so that a scan of the compacted    \n"
+"    table gives the same hits as a scan of the manifest did; a rebuild over  \n"
+"    all the sequences may censor more words.                                 \n"
+"--no-censor (-C)                                                             \n"
+"    Do not censor over-represented words. By default, except with            \n"
+"    --manifest, the rule of format_lookup is applied to the merged counts,   \n"
+"    which is what a build over all the sequences at once would have done,    \n"
+"    provided the inputs were not censored themselves (format_lookup --part   \n"
+"    does not censor)                                                         \n"
+"--verbose=<integer> (-v)                                                     \n"
+"    Verbosity level. 0 (normal) by default. Negative enables debugging       \n"
+"    messages. Positive makes program quieter.                                \n"
+"--help (-h)                                                                  \n"
+"    Prints this message.                                                     \n"
+"                                                                             \n"
+,program_name, program_name);
+
+}
+
+static void parse_arguments(int argc, char *argv[]) {
+  int option_index, commandline_error, rval;
+  struct option longopts[] = {
+    { "output", 1, NULL, 'o'},
+    { "manifest", 1, NULL, 'm'},
+    { "no-censor", 0, NULL, 'C'},
+    { "verbose", 1, NULL, 'v'},
+    { "help", 0, NULL, 'h'},
+    { NULL, 0, NULL, 0}
+  };
+  char *optstring = "o:m:v:Ch";
+
+  commandline_error = 0;
+  while((rval = getopt_long(argc, argv, optstring, longopts, &option_index))
+	!= -1) {
+    switch(rval) {
+    case ':':
+      logmsg(MSG_ERROR,"\n! Option \"%s\" requires an argument.\n",
+	     longopts[option_index].name);
+      commandline_error = 1;
+      break;
+    case 'o':
+      output_filename = strdup(optarg);
+      break;
+    case 'm':
+      manifest_filename = strdup(optarg);
+      break;
+    case 'C':
+      censor = 0;
+      break;
+    case 'v':
+      verbosity_level = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+      break;
+    case '?':
+    default:
+      logmsg(MSG_ERROR,"\n! Option \"%c\" unknown.\n",optopt);
+      commandline_error = 1;
+      break;
+    }
+  }
+
+  if (manifest_filename) {
+    if (output_filename != NULL || optind < argc) {
+      logmsg(MSG_ERROR,"! With --manifest, no output or input tables are "
+	     "given\n");
+      commandline_error = 1;
+    }
+  } else {
+    if (output_filename == NULL) {
+      logmsg(MSG_ERROR,"! Output lookup table must be specified with -o "
+	     "<file> or --output=<file> option\n");
+      commandline_error = 1;
+    }
+    if (optind >= argc) {
+      logmsg(MSG_ERROR,"! No lookup tables to merge\n");
+      commandline_error = 1;
+    }
+  }
+
+  if (commandline_error) {
+    logmsg(MSG_ERROR,"! Program halted due to command line option errors\n");
+    usage(argv[0]);
+    exit(-1);
+  }
+}
+
+static int input_compare(const void *a, const void *b) {
+  const input_t *x = a, *y = b;
+
+  if (x->h.seq_start != y->h.seq_start)
+    return x->h.seq_start < y->h.seq_start ? -1 : 1;
+  return 0;
+}
+
+/* Opens the inputs, reads their headers and word records, and sorts them
+   by sequence range. They must index the same words, and their sequence
+   ranges must not overlap. */
+static void open_inputs(input_t *in, int n_inputs) {
+  int k;
+  uint range;
+
+  for(k=0;k<n_inputs;k++) {
+    in[k].f = fopen(in[k].filename, "r");
+    if (in[k].f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening lookup file %s (%s)\n",
+	     in[k].filename, strerror(errno));
+    }
+    read_lookup_header(in[k].f, (uchar *) in[k].filename, &in[k].h);
+    if (in[k].h.flags != 0) {
+      logmsg(MSG_FATAL,"! %s is a sparse or fine layer table, which can not "
+	     "be merged\n", in[k].filename);
+    }
+    if (in[k].h.wordsize != in[0].h.wordsize ||
+	in[k].h.word_start != in[0].h.word_start ||
+	in[k].h.word_end != in[0].h.word_end) {
+      logmsg(MSG_FATAL,"! %s and %s do not index the same words\n",
+	     in[k].filename, in[0].filename);
+    }
+    range = in[k].h.word_end - in[k].h.word_start;
+    MA(in[k].meta, sizeof(lookupmeta_t)*range);
+    if (fread(in[k].meta, sizeof(lookupmeta_t), range, in[k].f) != range) {
+      logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", in[k].filename);
+    }
+  }
+
+  qsort(in, n_inputs, sizeof(input_t), input_compare);
+  for(k=1;k<n_inputs;k++) {
+    if (in[k].h.seq_start <= in[k-1].h.seq_end) {
+      logmsg(MSG_FATAL,"! Sequence ranges of %s (%u - %u) and %s (%u - %u) "
+	     "overlap\n", in[k-1].filename, in[k-1].h.seq_start,
+	     in[k-1].h.seq_end, in[k].filename, in[k].h.seq_start,
+	     in[k].h.seq_end);
+    }
+    if (in[k].h.seq_start != in[k-1].h.seq_end + 1) {
+      logmsg(MSG_WARNING,"Sequences %u - %u are in none of the tables\n",
+	     in[k-1].h.seq_end + 1, in[k].h.seq_start - 1);
+    }
+  }
+}
+
+/* Sums the word counts of the inputs into <meta>, censoring with the rule
+   of format_lookup's censor_words(), and sets the file offsets of the
+   merged posting lists. Returns the number of postings kept. */
+static uint merge_meta(input_t *in, int n_inputs, lookup_header_t *h,
+		       lookupmeta_t *meta) {
+  uint range, w, total, censored, offset;
+  double expect;
+  int k;
+
+  range = h->word_end - h->word_start;
+  total = censored = 0;
+  for(w=0;w<range;w++) {
+    meta[w].n_words = 0;
+    meta[w].start_pos = 0;
+    for(k=0;k<n_inputs;k++) {
+      meta[w].n_words += in[k].meta[w].n_words;
+      if (in[k].meta[w].start_pos == CENSORED_WORD) 
+	meta[w].start_pos = CENSORED_WORD;
+    }
+    total += meta[w].n_words;
+    /* A word censored in one input stays censored */
+    if (meta[w].start_pos == CENSORED_WORD) {
+      censored += meta[w].n_words;
+      meta[w].n_words = 0;
+    }
+  }
+
+  if (censor) {
+    expect = (double) total/(double) ((0x1 << h->wordsize*2) - 1);
+    for(w=0;w<range;w++) {
+      if (meta[w].n_words > expect*50) {
+	logmsg(MSG_DEBUG1,"Censoring word: %0X (%d obs out of %d total, "
+	       "expect = %5.2f)\n", w + h->word_start, meta[w].n_words, total,
+	       expect);
+	censored += meta[w].n_words;
+	meta[w].n_words = 0;
+	meta[w].start_pos = CENSORED_WORD;
+      }
+    }
+  }
+  logmsg(MSG_INFO,"Censored %u postings of over-represented words\n",
+	 censored);
+
+  offset = lookup_header_size(h) + range*sizeof(lookupmeta_t);
+  for(w=0;w<range;w++) {
+    if (meta[w].start_pos != CENSORED_WORD) meta[w].start_pos = offset;
+    offset += meta[w].n_words*sizeof(word_t);
+  }
+
+  return total - censored;
+}
+
+/* Copies the posting lists word by word. The postings of each input are
+   stored in word order, so every input is read sequentially and only the
+   postings of one word are held in memory at a time. */
+static void merge_postings(input_t *in, int n_inputs, lookup_header_t *h,
+			   lookupmeta_t *meta, FILE *out) {
+  uint range, w, n;
+  int k, bufsize;
+  word_t *buf;
+
+  range = h->word_end - h->word_start;
+  buf = NULL;
+  bufsize = 0;
+  for(w=0;w<range;w++) {
+    for(k=0;k<n_inputs;k++) {
+      n = in[k].meta[w].n_words;
+      if (n == 0) continue;
+      if (bufsize < n) {
+	bufsize = n;
+	RA(buf, bufsize, sizeof(word_t));
+      }
+      if (fread(buf, sizeof(word_t), n, in[k].f) != n) {
+	logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", in[k].filename);
+      }
+      if (meta[w].n_words > 0) fwrite(buf, sizeof(word_t), n, out);
+    }
+  }
+  free(buf);
+}
+
+/* Returns the number of postings of the inputs left out of the merged
+   table */
+static uint merge_tables(char **filenames, int n_inputs, 
+			 char *output_filename) {
+  input_t *in;
+  int k;
+  uint n_postings;
+  lookup_header_t h;
+  lookupmeta_t *meta;
+  FILE *out;
+
+  CA(in, n_inputs, sizeof(input_t));
+  for(k=0;k<n_inputs;k++) in[k].filename = filenames[k];
+  open_inputs(in, n_inputs);
+
+  h = in[0].h;
+  h.seq_start = in[0].h.seq_start;
+  h.seq_end = in[n_inputs-1].h.seq_end;
+  h.table_index = 0;
+  MA(meta, sizeof(lookupmeta_t)*(h.word_end - h.word_start));
+  h.table_size = merge_meta(in, n_inputs, &h, meta);
+  n_postings = 0;
+  for(k=0;k<n_inputs;k++) n_postings += in[k].h.table_size;
+
+  logmsg(MSG_INFO,"Writing %s: %d tables, sequences %u - %u, %u postings\n",
+	 output_filename, n_inputs, h.seq_start, h.seq_end, h.table_size);
+  out = fopen(output_filename, "w");
+  if (out == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
+	   output_filename, strerror(errno));
+  }
+  write_lookup_header(out, &h);
+  fwrite(meta, sizeof(lookupmeta_t), h.word_end - h.word_start, out);
+  merge_postings(in, n_inputs, &h, meta, out);
+  fclose(out);
+
+  for(k=0;k<n_inputs;k++) {
+    fclose(in[k].f);
+    free(in[k].meta);
+  }
+  free(in);
+  free(meta);
+  return n_postings - h.table_size;
+}
+
+/* Folds the deltas of a manifest into its last base table. The merged
+   table is written under a temporary name and renamed over the base, and
+   the manifest is replaced the same way, so readers see either the old or
+   the new set of tables. */
+static void compact_manifest(void) {
+  manifest_entry_t *entries;
+  char **inputs, *temp, *base_filename;
+  int n, n_inputs, base, i;
+  uint dropped;
+
+  n = read_manifest((uchar *) manifest_filename, &entries);
+  base = -1;
+  for(i=0;i<n;i++) {
+    if (!entries[i].delta) base = i;
+  }
+  if (base < 0) {
+    logmsg(MSG_FATAL,"! Manifest %s lists no base table\n",
+	   manifest_filename);
+  }
+
+  base_filename = (char *) entries[base].filename;
+  MA(inputs, sizeof(char *)*n);
+  n_inputs = 0;
+  inputs[n_inputs++] = base_filename;
+  for(i=0;i<n;i++) {
+    if (entries[i].delta) inputs[n_inputs++] = (char *) entries[i].filename;
+  }
+  if (n_inputs == 1) {
+    logmsg(MSG_INFO,"No delta tables to fold into %s\n", base_filename);
+    return;
+  }
+
+  MA(temp, strlen(base_filename) + 8);
+  sprintf(temp, "%s.tmp", base_filename);
+  /* Scans of the manifest use every posting of its tables, as deltas
+     already leave out the words censored in the base. Censoring more on 
+     the merged counts would change their hits, so the compacted table must
+     keep them all. */
+  censor = 0;
+  dropped = merge_tables(inputs, n_inputs, temp);
+  if (dropped > 0) {
+    unlink(temp);
+    logmsg(MSG_FATAL,"! Folding the deltas into %s would drop %u postings "
+	   "that scans of %s use, so the tables are left as they are\n",
+	   base_filename, dropped, manifest_filename);
+  }
+  if (rename(temp, base_filename) != 0) {
+    logmsg(MSG_FATAL,"! Failed renaming %s to %s (%s)\n", temp, 
+	   base_filename, strerror(errno));
+  }
+
+  for(i=0, n_inputs=0;i<n;i++) {
+    if (!entries[i].delta) entries[n_inputs++] = entries[i];
+  }
+  write_manifest((uchar *) manifest_filename, entries, n_inputs);
+  for(i=0;i<n;i++) {
+    if (entries[i].delta) unlink((char *) entries[i].filename);
+  }
+  logmsg(MSG_INFO,"Folded %d delta tables into %s\n", n - n_inputs,
+	 base_filename);
+  free(temp);
+  free(inputs);
+}
+
+/* Lists a table merged into <database>.lt.N as the base table of 
+   <database>.manifest, as format_lookup does for the tables it writes.
+   Other names are left without a manifest. */
+static void write_output_manifest(char *output_filename) {
+  manifest_entry_t entry;
+  char *filename, *p;
+
+  p = strrchr(output_filename, '.');
+  if (p == NULL || p[1] == '\0' || strspn(p + 1, "0123456789") != 
+      strlen(p + 1) || p - output_filename < 3 || strncmp(p - 3, ".lt", 3)) {
+    logmsg(MSG_INFO,"%s is not named <database>.lt.N, no manifest "
+	   "written\n", output_filename);
+    return;
+  }
+  MA(filename, p - output_filename + 16);
+  sprintf(filename, "%.*s.manifest", (int) (p - 3 - output_filename), 
+	  output_filename);
+  entry.filename = (uchar *) output_filename;
+  entry.delta = 0;
+  write_manifest((uchar *) filename, &entry, 1);
+  logmsg(MSG_INFO,"Listed %s in %s\n", output_filename, filename);
+  free(filename);
+}
+
+int main(int argc, char *argv[]) {
+
+  configure_logmsg(MSG_DEBUG1);
+  parse_arguments(argc, argv);
+  configure_logmsg(verbosity_level);
+
+  if (manifest_filename) {
+    compact_manifest();
+  } else {
+    merge_tables(argv + optind, argc - optind, output_filename);
+    write_output_manifest(output_filename);
+  }
+
+  return 0;
+}
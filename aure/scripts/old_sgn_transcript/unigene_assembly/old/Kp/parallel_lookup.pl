@@ -0,0 +1,61 @@
+#!/usr/bin/perl -w
+use strict;
+
+if (@ARGV < 2 || $ARGV[0] eq "help") {
+  print <<EOF;
+
+  Builds the lookup table of a formatted sequence database with several
+  local format_lookup processes, one per part of the database (format_lookup
+  --part), then combines their tables into <database>.lt.0 with
+  merge_lookup. This is the single host version of spreading the build
+  over batch nodes, each running format_lookup --part=<i>/<n>.
+
+  Usage: parallel_lookup.pl <database> <n_processes> [format_lookup options]
+
+  The memory given with --memsize is per process. Do not give --basename.
+  The part tables are removed after the merge, and <database>.manifest
+  lists the merged table, so format_lookup --delta can add to it.
+
+EOF
+  exit 0;
+}
+
+my ($database, $n_parts, @options) = @ARGV;
+my $bindir = $0;
+$bindir =~ s![^/]*$!!;
+$bindir = "./" if ($bindir eq "");
+
+# Tables of each part are <database>.p<i>.lt.N. Those of an earlier run
+# are removed first, and only parts 1 to n_parts are merged, so that
+# tables left by a failed run or one with more parts are never picked up.
+sub part_tables {
+  my @tables;
+  for(my $i=1;$i<=$n_parts;$i++) {
+    push @tables, glob("$database.p$i.lt.*");
+  }
+  return @tables;
+}
+unlink part_tables();
+
+my @pids;
+for(my $i=1;$i<=$n_parts;$i++) {
+  my $pid = fork();
+  die "Failed forking ($!)" unless defined($pid);
+  if ($pid == 0) {
+    exec("${bindir}format_lookup", "-d", $database, "--part=$i/$n_parts",
+	 @options) or die "Failed running ${bindir}format_lookup ($!)";
+  }
+  push @pids, $pid;
+}
+
+my $failed = 0;
+foreach my $pid (@pids) {
+  waitpid($pid, 0);
+  $failed++ if ($? != 0);
+}
+die "$failed of $n_parts format_lookup processes failed" if ($failed);
+
+my @tables = part_tables();
+system("${bindir}merge_lookup", "-o", "$database.lt.0", @tables) == 0
+  or die "merge_lookup failed";
+unlink @tables;
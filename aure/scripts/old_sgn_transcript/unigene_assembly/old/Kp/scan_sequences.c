@@ -5,25 +5,170 @@
 #include <assert.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "kp_types.h"
 #include "log_message.h"
+#include "lookup_table.h"
+#include "hit_file.h"
 
 #define SCORE_THRESHOLD (75)
+/* Queries per block handed to a scanning thread, unless --batch sets it */
+#define QUERY_BLOCK 16
+/* Query words between a lookup and the prefetch of the table entry of a 
+   later word, unless --prefetch sets it. Off until a gain is measured with
+   --probe-benchmark. */
+#define PREFETCH_DISTANCE 0
+/* Seconds between checkpoints, unless --checkpoint-interval sets it */
+#define CHECKPOINT_INTERVAL 300
+/* Word hit counts per target and strand saturate at this */
+#define COUNT_MAX USHRT_MAX
+/* Entries of hits_byseq (2*target + strand) per block of counts */
+#define COUNT_BLOCK 64
+/* Tables with more entries in hits_byseq than this keep track of the 
+   blocks a query counts in, rather than sweeping them all */
+#define COUNT_SPARSE_ENTRIES (1 << 18)
 
 static uchar *lookup_filename = NULL;
+static uchar *manifest_filename = NULL;
+/* All the lookup files to scan against, from --lookupfile, the command
+   line or the manifest. memsize bounds the tables loaded at once. */
+static uchar **lookup_filenames = NULL;
+static int n_lookupfiles = 0;
+static int memsize = 0;
 static uchar *seq_filename = NULL;
+static uchar *query_filename = NULL;
+/* --query-start, --query-end: the queries scanned are those from 
+   query_start up to, and not including, query_end */
+static uint query_start = 0, query_end = UINT_MAX;
+/* --output: file the hits are written to instead of stdout, which 
+   --checkpoint needs to take up an interrupted run */
+static uchar *output_filename = NULL;
+static uchar *checkpoint_filename = NULL;
+static int checkpoint_interval = CHECKPOINT_INTERVAL;
 static uint verbosity_level = 0;
+static int min_quality = 0;
 static uint wordsize;
 static uint mask;
+/* Length of the words behind the hits being chained: wordsize, or the
+   fine layer word size with --refine */
+static uint hit_wordsize;
 
 static lookupmeta_t *lookup_meta;
 static word_t **lookup_data;
 static word_t *lookup;
 
+/* Sparse lookup tables (format_lookup --sparse) are loaded into an open
+   addressing hash table of sparse_mask + 1 slots, instead of lookup_meta
+   and lookup_data. Empty slots have n_words == 0. */
+typedef struct {
+  uint word;
+  int n_words;
+  word_t *data;
+} sparseslot_t;
+
+static sparseslot_t *sparse_slots = NULL;
+static uint sparse_mask;
+static uint *bloom = NULL;
+static int use_bloom = 1;
+
 static uint n_seq = -1;
 static seqmeta_t *seqmeta = NULL;
+
+/* A formatted sequence database. The targets are those of --seqfile, 
+   whose seqmeta and n_seq are also kept in the globals of the same name. 
+   The queries are the targets themselves, or with --queries those of a 
+   database of their own, scanned against every target. */
+typedef struct {
+  uchar *basename;
+  uint n_seq;
+  seqmeta_t *meta;
+  FILE *binfile, *qualfile;
+  int bin_fd, qual_fd;
+  /* Whole .sbin and .qbin files, read once when the tables are scanned in
+     several rounds (see scan_table_groups()) */
+  uchar *store, *qual_store;
+  /* The .sbin mapped with --two-hit, whose word hits are extended against
+     the targets in place (see map_sequences()) */
+  uchar *map;
+  size_t map_size;
+} seqdb_t;
+
+static seqdb_t target_db;
+static seqdb_t *query_db = &target_db;
+
+/* Whether <target> is reported for query <seq_id>: scanning a database 
+   against itself, each pair is reported once, from the query on */
+static inline int target_reported(uint target, uint seq_id) {
+  return query_db != &target_db || target >= seq_id;
+}
+
 static uint ltable_start, ltable_end;
+static lookup_header_t ltable_header;
+
+/* Targets need at least count_threshold/2 word hits to be considered. This
+   is lowered to 1 when writing partial results (--partial), as the counts of
+   word-range partitioned tables only reach their totals in --merge */
+static int count_threshold = SCORE_THRESHOLD;
+static int partial_output = 0;
+static int merge_partials = 0;
+static int n_threads = 1;
+static int diagonal_runs = 0;
+static int binary_output = 0;
+/* --verify: banded alignment of every reported hit, keeping those of at
+   least min_identity percent identity */
+static int verify = 0;
+static double min_identity = 0.0;
+/* --two-hit: score the ungapped extension of a pair of word hits must 
+   reach for the target to be chained, 0 if off */
+static int two_hit_score = 0;
+/* --batch: queries are scanned a block of query_block at a time (see 
+   scan_batch()) */
+static int batch = 0;
+static int query_block = QUERY_BLOCK;
+/* --prefetch: see prefetch_ahead(), 0 if off. --probe-benchmark times the
+   word lookups of the queries instead of scanning them. */
+static int prefetch_distance = PREFETCH_DISTANCE;
+static int probe_benchmark = 0;
+/* --max-targets: targets reported per query and strand, the best chains
+   kept by chain_hit_runs(), 0 for all */
+static int max_targets = 0;
+/* --stats: file the counters and stage timers of the scan are written to,
+   as a line of JSON at the end and every stats_every queries if set */
+static uchar *stats_filename = NULL;
+static FILE *stats_file;
+static int stats_every = 0;
+
+/* Stages of scanning a query timed by --stats, see stage_done() */
+enum { STAGE_LOOKUP, STAGE_FILTER, STAGE_COMPILE, STAGE_SORT, STAGE_COMBINE,
+       STAGE_CHAIN, STAGE_VERIFY, STAGE_OUTPUT, N_STAGES };
+static char *stage_names[N_STAGES] = { "lookup", "filter", "compile", "sort",
+				       "combine", "chain", "verify", 
+				       "output" };
+
+/* Counters of a thread's scan, added to total_stats as blocks finish */
+typedef struct {
+  double queries;
+  double words;       /* query words looked up, both strands */
+  double distinct;    /* distinct words among them, see dedup_words() */
+  double postings;    /* postings of those words, counted per word */
+  double walked;      /* postings read, once per distinct word */
+  double targets;     /* target strands passing the count threshold */
+  double hits;        /* word hits of those targets */
+  double runs;        /* runs of consecutive word hits chained */
+  double chain_nodes;
+  double pairs;       /* query and target strands reported */
+  long long ns[N_STAGES];
+} scan_stats_t;
 
 
 typedef struct {
@@ -33,386 +178,1909 @@ typedef struct {
   int length;
 } wordhit_t;
 
-inline int mergesort_compare(wordhit_t *a, wordhit_t *b) {
-  if (a->db_seq < b->db_seq) return -1;
-  else if (a->db_seq > b->db_seq) return 1;
-  else {
-    if (a->di < b->di) return -1;
-    else if (a->di > b->di) return 1;
-    else {
-      if (a->pos < b->pos) return -1;
-      else if (a->pos > b->pos) return 1;
-      else return 0;
-    }
-  }
-}
-
-
-#define SWAP(x,y) ((x)^=(y),(y)^=(x),(x)^=(y))
-static void wordhit_mergesort_actual(wordhit_t *hits, int s, int e, 
-				     wordhit_t *tspace) {
-  int i,j,half,f,x;
-
-  if (e - s > 7) {
-    half = s + (e-s)/2;
-    wordhit_mergesort_actual(hits, s, half, tspace);
-    wordhit_mergesort_actual(hits, half, e, tspace);
-    i = s;
-    j = half;
-    f = 0;
-    while(i < half && j < e) {
-      x = mergesort_compare(hits + i, hits + j);
-      if (x == -1) {
-	tspace[f++] = hits[i++];
-      } else {
-	tspace[f++] = hits[j++];
-      }
-    }
-    assert((i < half || j < e) && !(i<half && j<e));
-    if (j < e) {
-      memcpy(hits + s, tspace, (j-s)*sizeof(wordhit_t));
-    } else {
-      memcpy(tspace + f, hits + i, (half-i)*sizeof(wordhit_t));
-      memcpy(hits + s, tspace, (e-s)*sizeof(wordhit_t));
-    }
+typedef struct {
+  int db_seq;
+  int min_di;
+  int max_di;
+  int score;
+  int start;
+  int end;
+  int s_start;
+  int s_end;
+  int length;
+  hit_alignment_t alignment;
+} hit_report_t;
+
+/* --two-hit: last word hit, per target and strand, and whether an 
+   extension has passed */
+typedef struct {
+  int last_di, last_pos;
+  int passed;
+} twohit_t;
+
+/* Words of both strands at a position of the query, kept unless 
+   --min-quality skips it */
+typedef struct {
+  uint word, rc_word;
+  int i;         /* position of the last base of the words */
+} queryword_t;
+
+/* A distinct word of the query, with its occurrences on either strand:
+   entries start to start + n[0] + n[1] - 1 of st->occurrences */
+typedef struct {
+  uint word;
+  int start;
+  int n[2];
+} distinctword_t;
+
+/* --batch: a word of a query of the block, see scan_batch() */
+typedef struct {
+  uint ref;      /* 2*(query - first query of the block) + strand */
+  int pos;
+} batchentry_t;
+
+/* Bump allocator for the buffers needed while scanning one strand of a
+   query, one per thread. Allocations are carved from a single block and
+   released all at once by arena_reset(). When the block runs out, the 
+   overflow is malloc()ed and the block is enlarged to the total at the 
+   next reset, so that it grows to the largest strand seen and the scan
+   then allocates nothing. */
+#define ARENA_ALIGN (16)
+
+typedef struct {
+  char *block;
+  size_t size, used, last;
+  void **overflow;
+  int n_overflow;
+  size_t overflow_size;
+} arena_t;
+
+static void *arena_alloc(arena_t *a, size_t size) {
+  void *p;
+
+  size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+  if (a->used + size <= a->size) {
+    a->last = a->used;
+    a->used += size;
+    return a->block + a->last;
+  }
+  MA(p, size > 0 ? size : ARENA_ALIGN);
+  PUSH(a->overflow, a->n_overflow, sizeof(void *));
+  a->overflow[a->n_overflow++] = p;
+  a->overflow_size += size;
+  return p;
+}
+
+/* Resizes <p>, of <old_size> bytes. The last allocation of the block is
+   extended in place when there is room. */
+static void *arena_realloc(arena_t *a, void *p, size_t old_size, 
+			   size_t size) {
+  void *q;
+  size_t aligned;
+
+  aligned = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+  if (p != NULL && p == a->block + a->last && a->last + aligned <= a->size) {
+    a->used = a->last + aligned;
+    return p;
+  }
+  q = arena_alloc(a, size);
+  if (p != NULL) memcpy(q, p, old_size);
+  return q;
+}
+
+static void arena_reset(arena_t *a) {
+  int k;
+
+  if (a->n_overflow > 0) {
+    for(k=0;k<a->n_overflow;k++) free(a->overflow[k]);
+    a->size = a->used + a->overflow_size;
+    free(a->block);
+    MA(a->block, a->size);
+    free(a->overflow);
+    a->overflow = NULL;
+    a->n_overflow = 0;
+    a->overflow_size = 0;
+  }
+  a->used = a->last = 0;
+}
+
+static void free_arena(arena_t *a) {
+
+  arena_reset(a);
+  free(a->block);
+}
+
+/* Everything that scanning a query modifies is kept per thread, so that
+   the threads share only the lookup table and the database, which are read
+   only. Output is collected in <out> and written by finish_block() in
+   query order. */
+typedef struct {
+  /* Word hits per target of the table and strand of the query. This is 
+     allocated once for efficiency, since it is needed for every sequence
+     comparison, but the size of the array is not known until the lookup 
+     table is loaded. Counts saturate at COUNT_MAX, see count_postings(). */
+  unsigned short *hits_byseq;
+  /* Blocks of COUNT_BLOCK entries of hits_byseq counted for the query, 
+     the only ones that are not zero: flagged in block_touched (of 
+     n_count_blocks, a multiple of 8) and listed by list_touched(). Small
+     tables have no block_touched, and every block is listed. And the 
+     word hits counted on each strand. */
+  uchar *block_touched;
+  int *touched;
+  int n_touched, n_count_blocks;
+  int strand_hits[2];
+  hit_report_t *report_hits;
+  uchar *seq, *qual;
+  /* Reverse complement of the query, made only with --refine */
+  uchar *rc_seq, *rc_qual;
+  int seqsize;
+  /* --verify: target sequence, and the band of the alignment in 
+     align_hit() */
+  uchar *target;
+  int target_size;
+  int *align_rows;
+  uchar *align_bt;
+  size_t align_rows_allocsize, align_bt_allocsize;
+  fineword_t *fine_query;
+  int fine_query_allocsize;
+  /* Words of the query, see gather_words(), and the distinct ones with
+     the position << 1 | strand of each of their occurrences and the hash
+     used to find them, see dedup_words() */
+  queryword_t *words;
+  int words_allocsize;
+  distinctword_t *distinct;
+  int *occurrences;
+  int n_distinct;
+  int *word_slots, *word_refs;
+  int word_slots_size;
+  /* Number of query words left out by --min-quality, reported at exit */
+  double skipped_words;
+  double sparse_lookups, bloom_rejects;
+  /* --two-hit: see two_hit(), and the targets dropped, reported at exit */
+  twohit_t *twohit;
+  double two_hit_rejects;
+  /* --max-targets: heap of the chains kept in report_hits, worst first,
+     and the targets left unchained, reported at exit */
+  int *best;
+  double pruned_targets;
+  /* --stats: counters, and the time the current stage started in ns */
+  scan_stats_t stats;
+  long long stage_mark;
+  /* Packed keys of the word hits and scratch space for sort_wordhits() */
+  unsigned long long *sort_keys, *sort_scratch;
+  int sort_allocsize;
+  /* --diagonal-runs: hash of the diagonals hit by the query, the list of
+     their slots, and the runs on them (see add_diagonal_hit()) */
+  struct diagslot_s *diag_slots;
+  uint diag_mask;
+  wordhit_t *diag_keys;
+  int n_diags, diag_keys_allocsize;
+  wordhit_t *runs;
+  int *run_next;
+  int n_runs, runs_allocsize;
+  /* --batch: the queries of the block, their words sorted by scan_batch()
+     and the postings of each word, and the hits of the block, in a slice
+     for each query and strand starting at batch_offsets[2*query + strand]
+     (queries counted from batch_first) */
+  uint batch_first;
+  uchar *batch_seq, *batch_qual;
+  size_t *batch_seq_offsets, batch_seqsize;
+  unsigned long long *batch_keys, *batch_scratch;
+  batchentry_t *batch_entries;
+  word_t **batch_postings;
+  int *batch_npostings;
+  int batch_allocsize;
+  wordhit_t *batch_hits;
+  size_t *batch_offsets, batch_hits_allocsize;
+  /* Word hits, runs and chaining buffers of the current query */
+  arena_t arena;
+  char *out;
+  size_t out_length, out_allocsize;
+} scan_state_t;
+
+static inline long long stage_clock(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return 1000000000LL*t.tv_sec + t.tv_nsec;
+}
+
+/* With --stats, stage_start() marks the start of a query's scan and 
+   stage_done() charges the time since the last mark to <stage> */
+static inline void stage_start(scan_state_t *st) {
+  if (stats_filename) st->stage_mark = stage_clock();
+}
+
+static inline void stage_done(scan_state_t *st, int stage) {
+  long long now;
+
+  if (stats_filename == NULL) return;
+  now = stage_clock();
+  st->stats.ns[stage] += now - st->stage_mark;
+  st->stage_mark = now;
+}
+
+static void init_scan_state(scan_state_t *st) {
+  int j;
+
+  memset(st, 0, sizeof(scan_state_t));
+  st->n_count_blocks = (2*(ltable_end - ltable_start + 1) + 
+			8*COUNT_BLOCK - 1)/(8*COUNT_BLOCK)*8;
+  CA(st->hits_byseq, st->n_count_blocks*COUNT_BLOCK, sizeof(unsigned short));
+  MA(st->touched, sizeof(int)*st->n_count_blocks);
+  if (st->n_count_blocks*COUNT_BLOCK > COUNT_SPARSE_ENTRIES) {
+    CA(st->block_touched, st->n_count_blocks, sizeof(uchar));
   } else {
-    for(i=s;i<e;i++) {
-      int min;
-      min = i;
-      for(j=i+1;j<e;j++)
-	if (mergesort_compare(hits + min, hits + j) == 1) min = j;
-      if (min != i) {
-	wordhit_t t;
-	t = hits[min];
-	hits[min] = hits[i];
-	hits[i] = t;
-      }
-    }
-  }
-}
-
-static void mergesort_bypos_actual(wordhit_t *hits, int s, int e, 
-				   wordhit_t *tspace) {
-  int i,j,half,f;
-
-  if (e - s > 7) {
-    half = s + (e-s)/2;
-    wordhit_mergesort_actual(hits, s, half, tspace);
-    wordhit_mergesort_actual(hits, half, e, tspace);
-    i = s;
-    j = half;
-    f = 0;
-    while(i < half && j < e) {
-      if (hits[i].pos < hits[j].pos) {
-	tspace[f++] = hits[i++];
-      } else {
-	tspace[f++] = hits[j++];
-      }
-    }
-    assert((i < half || j < e) && !(i<half && j<e));
-    if (j < e) {
-      memcpy(hits + s, tspace, (j-s)*sizeof(wordhit_t));
-    } else {
-      memcpy(tspace + f, hits + i, (half-i)*sizeof(wordhit_t));
-      memcpy(hits + s, tspace, (e-s)*sizeof(wordhit_t));
+    for(j=0;j<st->n_count_blocks;j++) st->touched[j] = j;
+    st->n_touched = st->n_count_blocks;
+  }
+  MA(st->report_hits, sizeof(hit_report_t)*(ltable_end - ltable_start + 1));
+  if (batch) {
+    MA(st->batch_offsets, sizeof(size_t)*(2*query_block + 1));
+    MA(st->batch_seq_offsets, sizeof(size_t)*(query_block + 1));
+  }
+  if (max_targets) {
+    MA(st->best, sizeof(int)*max_targets);
+  }
+  if (two_hit_score) {
+    MA(st->twohit, sizeof(twohit_t)*2*(ltable_end - ltable_start + 1));
+    for(j=0;j<2*(ltable_end - ltable_start + 1);j++) {
+      st->twohit[j].last_pos = -1;
+      st->twohit[j].passed = 0;
     }
-  } else {
-    for(i=s;i<e;i++) {
-      int min;
-      min = i;
-      for(j=i+1;j<e;j++)
-	if (hits[j].pos < hits[min].pos) min = j;
-      if (min != i) {
-	wordhit_t t;
-	t = hits[min];
-	hits[min] = hits[i];
-	hits[i] = t;
-      }
+  }
+}
+
+static void free_scan_state(scan_state_t *st) {
+  free_arena(&st->arena);
+  free(st->sort_keys);
+  free(st->sort_scratch);
+  free(st->diag_slots);
+  free(st->diag_keys);
+  free(st->runs);
+  free(st->run_next);
+
+  free(st->hits_byseq);
+  free(st->block_touched);
+  free(st->touched);
+  free(st->report_hits);
+  free(st->seq);
+  free(st->qual);
+  free(st->rc_seq);
+  free(st->rc_qual);
+  free(st->target);
+  free(st->align_rows);
+  free(st->align_bt);
+  free(st->twohit);
+  free(st->best);
+  free(st->batch_seq);
+  free(st->batch_qual);
+  free(st->batch_seq_offsets);
+  free(st->batch_keys);
+  free(st->batch_scratch);
+  free(st->batch_entries);
+  free(st->batch_postings);
+  free(st->batch_npostings);
+  free(st->batch_hits);
+  free(st->batch_offsets);
+  free(st->fine_query);
+  free(st->words);
+  free(st->distinct);
+  free(st->occurrences);
+  free(st->word_slots);
+  free(st->word_refs);
+  free(st->out);
+}
+
+static void out_write(scan_state_t *st, void *data, size_t size) {
+
+  if (st->out_length + size > st->out_allocsize) {
+    while(st->out_length + size > st->out_allocsize) {
+      st->out_allocsize = st->out_allocsize ? st->out_allocsize*2 : 4096;
     }
+    RA(st->out, st->out_allocsize, sizeof(char));
   }
+  memcpy(st->out + st->out_length, data, size);
+  st->out_length += size;
 }
 
-static void wordhit_mergesort(wordhit_t *hits, int s, int e) {
-  wordhit_t *tspace;
-  
-  MA(tspace, (e-s)*sizeof(wordhit_t));
-  wordhit_mergesort_actual(hits, s, e, tspace);
-  free(tspace);
+static void out_printf(scan_state_t *st, char *format, ...) {
+  va_list ap;
+  char line[512];
+  int l;
+
+  va_start(ap, format);
+  l = vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+  out_write(st, line, l < sizeof(line) ? l : sizeof(line) - 1);
 }
 
-static void mergesort_bypos(wordhit_t *hits, int s, int e) {
-  wordhit_t *tspace;
+static int wordhit_compare(const void *c, const void *d) {
+  const wordhit_t *a = c, *b = d;
+
+  if (a->db_seq != b->db_seq) return a->db_seq < b->db_seq ? -1 : 1;
+  if (a->di != b->di) return a->di < b->di ? -1 : 1;
+  if (a->pos != b->pos) return a->pos < b->pos ? -1 : 1;
+  return 0;
+}
 
-  MA(tspace, (e-s)*sizeof(wordhit_t));
-  mergesort_bypos_actual(hits, s, e, tspace);
-  free(tspace);
+static int bits_needed(unsigned int x) {
+  int b;
 
+  for(b=0;x;b++) x >>= 1;
+  return b;
 }
 
+/* Stable LSD radix sort of <n> keys on the bytes of bits lo_bit to 
+   hi_bit - 1, skipping the bytes that are 0 in <varying> (the bits that 
+   are not the same in every key). <tmp> is scratch space of the same size.
+   Returns the one of <keys> and <tmp> left holding the sorted keys. */
+static unsigned long long *radix_sort_keys(unsigned long long *keys, 
+					   unsigned long long *tmp, int n,
+					   unsigned long long varying,
+					   int lo_bit, int hi_bit) {
+  unsigned long long *t;
+  int count[256];
+  int shift, i;
+
+  for(shift=lo_bit;shift<hi_bit;shift+=8) {
+    if (((varying >> shift) & 0xFF) == 0) continue;
+    memset(count, 0, sizeof(count));
+    for(i=0;i<n;i++) count[(keys[i] >> shift) & 0xFF]++;
+    for(i=1;i<256;i++) count[i] += count[i-1];
+    for(i=n-1;i>=0;i--) tmp[--count[(keys[i] >> shift) & 0xFF]] = keys[i];
+    t = keys;
+    keys = tmp;
+    tmp = t;
+  }
+  return keys;
+}
 
-static int wordhit_compare(const void *c, const void *d) {
-  wordhit_t *a, *b;
+/* Sorts word hits by target, diagonal and position. The three fields, less
+   their minimum, are packed into a 64-bit key which is sorted by 
+   radix_sort_keys(), and the hits are then unpacked from the sorted keys.
+   Hits whose fields do not fit in 64 bits are sorted with qsort. */
+static void sort_wordhits(scan_state_t *st, wordhit_t *hits, int n_hits) {
+  unsigned long long *keys, all_or, all_and, key;
+  int min_seq, max_seq, min_di, max_di, min_pos, max_pos;
+  int di_bits, pos_bits, n_bits, i;
+
+  if (n_hits < 2) return;
+  min_seq = max_seq = hits[0].db_seq;
+  min_di = max_di = hits[0].di;
+  min_pos = max_pos = hits[0].pos;
+  for(i=1;i<n_hits;i++) {
+    if (hits[i].db_seq < min_seq) min_seq = hits[i].db_seq;
+    if (hits[i].db_seq > max_seq) max_seq = hits[i].db_seq;
+    if (hits[i].di < min_di) min_di = hits[i].di;
+    if (hits[i].di > max_di) max_di = hits[i].di;
+    if (hits[i].pos < min_pos) min_pos = hits[i].pos;
+    if (hits[i].pos > max_pos) max_pos = hits[i].pos;
+  }
+  pos_bits = bits_needed(max_pos - min_pos);
+  di_bits = bits_needed(max_di - min_di);
+  n_bits = bits_needed(max_seq - min_seq) + di_bits + pos_bits;
+  if (n_bits > 64) {
+    qsort(hits, n_hits, sizeof(wordhit_t), wordhit_compare);
+    return;
+  }
 
-  a = (wordhit_t *) c;
-  b = (wordhit_t *) d;
-  
-  if (a->db_seq < b->db_seq) return -1;
-  else if (a->db_seq > b->db_seq) return 1;
-  else {
-    if (a->di < b->di) return -1;
-    else if (a->di > b->di) return 1;
-    else {
-      if (a->pos < b->pos) return -1;
-      else if (a->pos > b->pos) return 1;
-      else return 0;
-    }
+  if (st->sort_allocsize < n_hits) {
+    st->sort_allocsize = n_hits;
+    RA(st->sort_keys, st->sort_allocsize, sizeof(unsigned long long));
+    RA(st->sort_scratch, st->sort_allocsize, sizeof(unsigned long long));
+  }
+  keys = st->sort_keys;
+  all_or = 0;
+  all_and = ~0ULL;
+  for(i=0;i<n_hits;i++) {
+    key = ((unsigned long long) (hits[i].db_seq - min_seq) << 
+	   (di_bits + pos_bits)) |
+      ((unsigned long long) (hits[i].di - min_di) << pos_bits) |
+      (unsigned long long) (hits[i].pos - min_pos);
+    keys[i] = key;
+    all_or |= key;
+    all_and &= key;
+  }
+
+  keys = radix_sort_keys(keys, st->sort_scratch, n_hits, all_or ^ all_and,
+			 0, n_bits);
+  for(i=0;i<n_hits;i++) {
+    key = keys[i];
+    hits[i].pos = (int) (key & ((1ULL << pos_bits) - 1)) + min_pos;
+    hits[i].di = (int) ((key >> pos_bits) & ((1ULL << di_bits) - 1)) + min_di;
+    hits[i].db_seq = (int) (key >> (di_bits + pos_bits)) + min_seq;
   }
 }
 
-typedef struct {
-  int db_seq;
-  int min_di;
-  int max_di;
-  int score;
-  int start;
-  int end;
-  int s_start;
-  int s_end;
-  int length;
-} hit_report_t;
+/* --refine: the fine layer of a layered lookup table (format_lookup 
+   --fine-wordsize). fine_words holds the sorted short words of each target,
+   starting at fine_offsets[target - ltable_start]. */
+static int refine = 0;
+static int coarse_hits = 1;
+static uint fine_wordsize;
+static uint *fine_offsets = NULL;
+static fineword_t *fine_words = NULL;
 
-/* This is allocated dynamically by main() after the lookup table is loaded,
-   for efficiency, since it is always needed by the below function, which is
-   called for every sequence comparison, but the size of the array is not
-   known until the lookup table is loaded */
-static int *hits_byseq = NULL;
+static int fineword_compare(const void *a, const void *b) {
+  const fineword_t *x = a, *y = b;
 
-static wordhit_t *find_wordmatches(uchar *seq, uint seq_id, int length, int *return_nhits) {
-  int n_hits;
-  int i,j,t;
-  uint word;
+  if (x->word != y->word) return x->word < y->word ? -1 : 1;
+  if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+  return 0;
+}
+
+/* Writes the reverse complement of <seq> (and reversed quality) to <to> */
+static void reverse_complement(uchar *to, uchar *seq, int length) {
+  int i;
+
+  for(i=0;i<length;i++) to[i] = seq[length - i - 1] ^ 0x3;
+}
+
+static void reverse_quality(uchar *to, uchar *qual, int length) {
+  int i;
+
+  for(i=0;i<length;i++) to[i] = qual[length - i - 1];
+}
+
+/* Second stage of find_wordmatches() with --refine. Targets with at least
+   coarse_hits word hits in hits_byseq are candidates; their word hits are
+   recomputed with the short words of the fine layer, by merging the sorted
+   short words of the query with those of the target, and the usual count
+   threshold is applied to those. The hits of a candidate are the same as
+   a scan with a table of the short words would give. <seq> is the query 
+   on <strand>, reverse complemented for strand 1. */
+static wordhit_t *refine_wordmatches(scan_state_t *st, uchar *seq, 
+				     uchar *qual, uint seq_id, int length, 
+				     int strand, int *return_nhits) {
+  fineword_t *query, *target;
   wordhit_t *hits;
-  
-  /* This implements a censoring technique to speed the execution of the 
-     program, by excluding spurious word matches to sequences (which would
-     trigger a single-source shortest path analysis) that can not in total
-     reach the output threshold. Also, by excluding these words from the
-     list of word hits, the sorting time for combining the word hits is also
-     reduced. */
-  for(j=0;j<(ltable_end - ltable_start);j++)
-    hits_byseq[j] = 0;
-  
-  /* Count the word hits */
+  uint word, fmask;
+  int i, j, n_query, n_hits, hits_allocsize, start, a, b, a_end, b_end;
+  int x, y, t_end, last_low;
+
+  if (st->fine_query_allocsize < length) {
+    st->fine_query_allocsize = length;
+    RA(st->fine_query, st->fine_query_allocsize, sizeof(fineword_t));
+  }
+  query = st->fine_query;
+  fmask = (0x1 << (fine_wordsize*2)) - 1;
+  n_query = 0;
   word = 0;
-  for(i=0;i<wordsize;i++) 
-    word = (word << 2) + seq[i];
-  for(j=0;j<lookup_meta[word].n_words;j++) {
-    hits_byseq[lookup_data[word][j].seq_id - ltable_start]++;
+  last_low = -1;
+  for(i=0;i<length;i++) {
+    word = ((word << 2) & fmask) | seq[i];
+    if (qual && qual[i] < min_quality) last_low = i;
+    if (i < fine_wordsize - 1 || i - last_low < fine_wordsize) continue;
+    query[n_query].word = word;
+    query[n_query].pos = (i == fine_wordsize - 1) ? 0 : i - fine_wordsize;
+    n_query++;
   }
-  for(;i<length;i++) {
-    word = ((word << 2) & mask) + seq[i];
-    for(j=0;j<lookup_meta[word].n_words;j++) {
-      hits_byseq[lookup_data[word][j].seq_id - ltable_start]++;
+  qsort(query, n_query, sizeof(fineword_t), fineword_compare);
+
+  hits = NULL;
+  n_hits = hits_allocsize = 0;
+  for(i=0;i<COUNT_BLOCK*st->n_touched;i+=2) {
+    j = (COUNT_BLOCK*st->touched[i/COUNT_BLOCK] + i%COUNT_BLOCK)/2;
+    if (!target_reported(j + ltable_start, seq_id) || 
+	st->hits_byseq[2*j + strand] < coarse_hits) continue;
+    start = n_hits;
+    target = fine_words;
+    b = fine_offsets[j];
+    t_end = fine_offsets[j+1];
+    a = 0;
+    while(a < n_query && b < t_end) {
+      if (query[a].word < target[b].word) {
+	a++;
+      } else if (query[a].word > target[b].word) {
+	b++;
+      } else {
+	for(a_end=a+1;a_end<n_query && query[a_end].word == query[a].word;
+	    a_end++);
+	for(b_end=b+1;b_end<t_end && target[b_end].word == target[b].word;
+	    b_end++);
+	if (n_hits + (a_end - a)*(b_end - b) > hits_allocsize) {
+	  while(n_hits + (a_end - a)*(b_end - b) > hits_allocsize) {
+	    hits_allocsize = hits_allocsize ? hits_allocsize*2 : 1024;
+	  }
+	  hits = arena_realloc(&st->arena, hits, sizeof(wordhit_t)*n_hits,
+			       sizeof(wordhit_t)*hits_allocsize);
+	}
+	for(x=a;x<a_end;x++) {
+	  for(y=b;y<b_end;y++) {
+	    hits[n_hits].db_seq = j + ltable_start;
+	    hits[n_hits].di = target[y].pos - query[x].pos;
+	    hits[n_hits].pos = query[x].pos;
+	    n_hits++;
+	  }
+	}
+	a = a_end;
+	b = b_end;
+      }
     }
-  }
-
-  n_hits = 0;
-  for(j=0;j<(ltable_end - ltable_start);j++) {
-    if ((j+ltable_start)>=seq_id && hits_byseq[j]*2 >= SCORE_THRESHOLD) {
-      n_hits += hits_byseq[j];
+    if ((n_hits - start)*2 < count_threshold) {
+      n_hits = start;
     } else {
-      hits_byseq[j] = 0;
+      st->stats.targets++;
     }
   }
-  if (n_hits == 0) {
-    *return_nhits = 0;
+
+  st->stats.hits += n_hits;
+  if (n_hits == 0) hits = NULL;
+  *return_nhits = n_hits;
+  return hits;
+}
+
+/* Returns the postings of <word> in the loaded table, their number in *n */
+static inline word_t *word_postings(scan_state_t *st, uint word, int *n) {
+  sparseslot_t *slot;
+  uint i;
+
+  if (sparse_slots == NULL) {
+    *n = lookup_meta[word].n_words;
+    return lookup_data[word];
+  }
+
+  st->sparse_lookups++;
+  if (bloom && !bloom_check(bloom, ltable_header.bloom_blocks, 
+			    ltable_header.bloom_probes, word)) {
+    st->bloom_rejects++;
+    *n = 0;
     return NULL;
   }
-  MA(hits, n_hits*sizeof(wordhit_t));
-  
-  /* Allocate the memory needed and then compile the records for each word */
-  t = 0;
-  word = 0;
-  for(i=0;i<wordsize;i++) 
-    word = (word << 2) + seq[i];
-  for(j=0;j<lookup_meta[word].n_words;j++) {
-    if (hits_byseq[lookup_data[word][j].seq_id - ltable_start] > 0) {
-      hits[t].db_seq = lookup_data[word][j].seq_id;
-      hits[t].di = lookup_data[word][j].seq_pos - (i - wordsize);
-      hits[t].pos = (i - wordsize);
-      t++;
-    }
+  i = (uint) (lookup_word_hash(word) >> 32) & sparse_mask;
+  for(;;) {
+    slot = sparse_slots + i;
+    if (slot->n_words == 0 || slot->word == word) break;
+    i = (i + 1) & sparse_mask;
   }
-  for(;i<length;i++) {
-    word = ((word << 2) & mask) + seq[i];
-    for(j=0;j<lookup_meta[word].n_words;j++) {
-      if (hits_byseq[lookup_data[word][j].seq_id - ltable_start] > 0) {
-	hits[t].db_seq = lookup_data[word][j].seq_id;
-	hits[t].di = lookup_data[word][j].seq_pos - (i - wordsize);
-	hits[t].pos = (i - wordsize);
-	t++;
-      }
-    }
+  *n = slot->n_words;
+  return slot->data;
+}
+
+/* The lookups of a query's words go all over a table much larger than the
+   cache, and each stalls on a miss for the table entry of the word and 
+   another for its postings. The scans look words up from a list made by
+   gather_words() and, at each word, prefetch the entries of the word 
+   prefetch_distance words ahead and the first postings of the one half as
+   far ahead, by which time its entry is in cache. <strands> selects the
+   forward (1) and reverse complement (2) words. */
+static inline void prefetch_entry(uint word) {
+  unsigned long long h;
+
+  if (sparse_slots == NULL) {
+    __builtin_prefetch(lookup_meta + word);
+    __builtin_prefetch(lookup_data + word);
+    return;
+  }
+  h = lookup_word_hash(word);
+  if (bloom) {
+    __builtin_prefetch(bloom_block(bloom, ltable_header.bloom_blocks, h));
   }
-  assert(t == n_hits);
+  __builtin_prefetch(sparse_slots + ((uint) (h >> 32) & sparse_mask));
+}
 
-  *return_nhits = n_hits;
-  return hits;
+static inline void prefetch_postings(uint word) {
+  sparseslot_t *slot;
+
+  if (sparse_slots == NULL) {
+    __builtin_prefetch(lookup_data[word]);
+    return;
+  }
+  slot = sparse_slots + ((uint) (lookup_word_hash(word) >> 32) & sparse_mask);
+  if (slot->word == word) __builtin_prefetch(slot->data);
 }
 
-static int combine_hits(wordhit_t *hits, int n_hits) {
-  int i,j,f;
+static inline void prefetch_ahead(queryword_t *words, int n_words, int p, 
+				  int strands) {
+  int a;
 
-  f = i = j = 0;
-  while(i < n_hits) {
-    while(j < n_hits                       && 
-	  hits[i].db_seq == hits[j].db_seq &&
-	  hits[i].di == hits[j].di         && 
-	  hits[j].pos - hits[i].pos == j - i) j++;
-    hits[f].di = hits[i].di;
-    hits[f].db_seq = hits[i].db_seq;
-    hits[f].pos = hits[i].pos;
-    hits[f].length = j - i + wordsize - 1;
-    f++;
-    i = j;
+  a = p + prefetch_distance;
+  if (a < n_words) {
+    if (strands & 1) prefetch_entry(words[a].word);
+    if (strands & 2) prefetch_entry(words[a].rc_word);
   }
+  a = p + prefetch_distance/2;
+  if (a > p && a < n_words) {
+    if (strands & 1) prefetch_postings(words[a].word);
+    if (strands & 2) prefetch_postings(words[a].rc_word);
+  }
+}
 
+/* The same over the distinct words of dedup_words() */
+static inline void prefetch_distinct(distinctword_t *distinct, int n, 
+				     int p) {
+  int a;
 
-  return f;
+  a = p + prefetch_distance;
+  if (a < n) prefetch_entry(distinct[a].word);
+  a = p + prefetch_distance/2;
+  if (a > p && a < n) prefetch_postings(distinct[a].word);
 }
 
-static int single_source_shortest_path(int *adjmatrix, int *pred, int *score,
-					wordhit_t *hits, int i, int j) {
-  int n_nodes;
-  int k, l, s;
+/* Lists the words of both strands of the query in st->words, leaving out 
+   with --min-quality those containing a low quality base, as they are 
+   when the lookup table is built. Returns their number. */
+static int gather_words(scan_state_t *st, uchar *seq, uchar *qual, 
+			int length) {
+  int i, n, last_low, rc_shift;
+  uint word, rc_word;
+
+  if (length > st->words_allocsize) {
+    st->words_allocsize = length;
+    RA(st->words, st->words_allocsize, sizeof(queryword_t));
+    RA(st->distinct, 2*st->words_allocsize, sizeof(distinctword_t));
+    RA(st->occurrences, 2*st->words_allocsize, sizeof(int));
+    RA(st->word_refs, 2*st->words_allocsize, sizeof(int));
+  }
+  rc_shift = 2*(wordsize - 1);
+  last_low = -1;
+  word = rc_word = 0;
+  n = 0;
+  for(i=0;i<length;i++) {
+    word = ((word << 2) & mask) | seq[i];
+    rc_word = (rc_word >> 2) | ((uint) (seq[i] ^ 0x3) << rc_shift);
+    if (qual && qual[i] < min_quality) last_low = i;
+    if (i < wordsize - 1) continue;
+    if (i - last_low < wordsize) {
+      st->skipped_words += 2;
+      continue;
+    }
+    st->words[n].word = word;
+    st->words[n].rc_word = rc_word;
+    st->words[n].i = i;
+    n++;
+  }
+  return n;
+}
 
-  /* Single source shortest path algorithm */
-  /* Selection sort on position */
-  if (j-i > 10) {
-    mergesort_bypos(hits, i, j);
+/* Counts <m> word hits for each of <n> postings on <strand> in hits_byseq,
+   <m> being the occurrences of their word on the strand, flagging the 
+   blocks of the entries in block_touched if there is one. The flags are
+   stored unconditionally: appending to a list of touched entries, or 
+   blocks, on their first hit costs more in the counting loop than 
+   list_touched() does afterwards. Counts stick at COUNT_MAX, which is
+   enough for the count threshold; apply_threshold() makes do with a bound
+   on the hits of a strand where a count saturated. They can only reach 
+   it once the hits of the strand do, and are incremented plainly until 
+   then. */
+static inline void count_postings(scan_state_t *st, word_t *postings, int n,
+				  int strand, int m) {
+  unsigned short *hits_byseq = st->hits_byseq;
+  uchar *block_touched = st->block_touched;
+  unsigned short c;
+  uint k;
+  int j;
+
+  if (st->strand_hits[strand] + (long long) n*m > COUNT_MAX) {
+    for(j=0;j<n;j++) {
+      k = 2*(postings[j].seq_id - ltable_start) + strand;
+      c = hits_byseq[k];
+      hits_byseq[k] = (c < COUNT_MAX - m) ? c + m : COUNT_MAX;
+      if (block_touched) block_touched[k/COUNT_BLOCK] = 1;
+    }
+  } else if (block_touched) {
+    for(j=0;j<n;j++) {
+      k = 2*(postings[j].seq_id - ltable_start) + strand;
+      hits_byseq[k] += m;
+      block_touched[k/COUNT_BLOCK] = 1;
+    }
   } else {
-    for(k=i;k<j;k++) {
-      int min;
-      min = k;
-      for(l=k+1;l<j;l++)
-	if (hits[l].pos < hits[min].pos) min = l;
-      if (min != k) {
-	SWAP(hits[min].db_seq,hits[k].db_seq);
-	SWAP(hits[min].di,hits[k].di);
-	SWAP(hits[min].pos,hits[k].pos);
-	SWAP(hits[min].length,hits[k].length);
-      }
+    for(j=0;j<n;j++) {
+      hits_byseq[2*(postings[j].seq_id - ltable_start) + strand] += m;
     }
   }
+  st->strand_hits[strand] += n*m;
+}
 
-  /* Adj matrix initialization */
-  n_nodes = j - i + 2;
-  memset(adjmatrix, 0x0, sizeof(int)*n_nodes*n_nodes);
-  for(k=i;k<j;k++) {
-    for(l=i;l<j;l++) {
-      if (hits[k].pos < hits[l].pos) {
-	adjmatrix[(k-i+1)*n_nodes + (l-i+1)] = abs(hits[k].di - hits[l].di)
-	  + abs(hits[k].pos + hits[k].length - hits[l].pos) + 1;
-      }	    
+/* Lists the blocks flagged by count_postings() in st->touched, in order,
+   testing the flags 8 at a time */
+static void list_touched(scan_state_t *st) {
+  unsigned long long flags;
+  int i, j;
+
+  if (st->block_touched == NULL) return;
+  st->n_touched = 0;
+  for(i=0;i<st->n_count_blocks;i+=8) {
+    memcpy(&flags, st->block_touched + i, sizeof(flags));
+    if (flags == 0) continue;
+    for(j=i;j<i+8;j++) {
+      if (st->block_touched[j]) st->touched[st->n_touched++] = j;
     }
   }
-  /* Boundary conditions: source has edge to every node (except sink node)
-     Every node (except source) has edge to sink node */
-  for(l=1;l<n_nodes-1;l++) {
-    adjmatrix[l] = 1;
-    adjmatrix[l*n_nodes + (n_nodes-1)] = 1;
+}
+
+/* Zeroes the blocks of hits_byseq counted for the last query, rather than
+   the whole array, which is mostly zero for short queries against a large
+   table */
+static void clear_counts(scan_state_t *st) {
+  int i;
+
+  st->strand_hits[0] = st->strand_hits[1] = 0;
+  if (st->block_touched == NULL) {
+    memset(st->hits_byseq, 0, 
+	   sizeof(unsigned short)*COUNT_BLOCK*st->n_count_blocks);
+    return;
   }
-  
-  /* State initialization for single-source shortest path */
-  for(k=0;k<n_nodes;k++) {
-    pred[k] = -1;
-    score[k] = INT_MIN;
+  for(i=0;i<st->n_touched;i++) {
+    memset(st->hits_byseq + COUNT_BLOCK*st->touched[i], 0, 
+	   sizeof(unsigned short)*COUNT_BLOCK);
+    st->block_touched[st->touched[i]] = 0;
   }
-  pred[0] = -1;
-  score[0] = 0;
-  
-  /* SSSP proper */
-  for(k=0;k<n_nodes;k++) {
-    for(l=0;l<n_nodes;l++) {
-      if (adjmatrix[k*n_nodes + l]) {
-	if (l>0 && l<n_nodes-1) {
-	  s = score[k] - adjmatrix[k*n_nodes + l] + hits[l + i - 1].length;
-	} else {
-	  s = score[k];
-	}
-	if (s > score[l]) {
-	  pred[l] = k;
-	  score[l] = s;
-	}
-      }
+  st->n_touched = 0;
+}
+
+/* Low complexity and repeat rich reads have the same word many times over,
+   on either strand. The <n_words> words of both strands gathered by 
+   gather_words() are listed in st->distinct once each, in order of first
+   occurrence, with their occurrences in order, so that the postings of a
+   word are read once however often it occurs. Words are found in a small
+   open addressing hash of the query's words, st->word_slots, holding the
+   index in st->distinct + 1, by Fibonacci hashing; the index found for 
+   each word is kept in st->word_refs for a second pass, which fills the
+   occurrences of each word from the end. The position an occurrence gives
+   its hits is worked out here: the first word of a strand is at position
+   0, as is the second, and every later word is at the position before its
+   first base, counting on the reverse complement for the reverse strand. */
+static void dedup_words(scan_state_t *st, int n_words, int length) {
+  queryword_t *words = st->words;
+  distinctword_t *d = st->distinct;
+  int *slots, *refs = st->word_refs;
+  int i, k, n, s, bits, pos;
+  uint word, slot_mask;
+
+  for(bits=2;(1 << bits)<4*n_words;bits++);
+  n = 1 << bits;
+  if (st->word_slots_size < n) {
+    st->word_slots_size = n;
+    RA(st->word_slots, st->word_slots_size, sizeof(int));
+  }
+  slots = st->word_slots;
+  slot_mask = n - 1;
+  memset(slots, 0, sizeof(int)*n);
+
+  st->n_distinct = 0;
+  for(i=0;i<2*n_words;i++) {
+    word = (i & 1) ? words[i/2].rc_word : words[i/2].word;
+    k = (word*0x9E3779B97F4A7C15ULL) >> (64 - bits);
+    while (slots[k] && d[slots[k] - 1].word != word) {
+      k = (k + 1) & slot_mask;
     }
+    if (slots[k] == 0) {
+      slots[k] = ++st->n_distinct;
+      d[slots[k] - 1].word = word;
+      d[slots[k] - 1].n[0] = d[slots[k] - 1].n[1] = 0;
+    }
+    refs[i] = slots[k] - 1;
+    d[refs[i]].n[i & 1]++;
+  }
+  for(i=n=0;i<st->n_distinct;i++) {
+    n += d[i].n[0] + d[i].n[1];
+    d[i].start = n;
+  }
+  for(i=2*n_words-1;i>=0;i--) {
+    s = i & 1;
+    if (s) {
+      pos = (words[i/2].i == length - 1) ? 0 : length - 2 - words[i/2].i;
+    } else {
+      pos = (words[i/2].i == wordsize - 1) ? 0 : words[i/2].i - wordsize;
+    }
+    st->occurrences[--d[refs[i]].start] = pos << 1 | s;
   }
+}
 
-  return n_nodes;
+/* Counts the word hits of the query's words per target and strand, 
+   reading the postings of each distinct word once */
+static void count_wordhits(scan_state_t *st, int n_words, int length) {
+  distinctword_t *d = st->distinct;
+  word_t *postings;
+  int n, p;
+
+  dedup_words(st, n_words, length);
+  for(p=0;p<st->n_distinct;p++) {
+    if (prefetch_distance) prefetch_distinct(d, st->n_distinct, p);
+    postings = word_postings(st, d[p].word, &n);
+    if (d[p].n[0]) count_postings(st, postings, n, 0, d[p].n[0]);
+    if (d[p].n[1]) count_postings(st, postings, n, 1, d[p].n[1]);
+    st->stats.walked += n;
+  }
+  list_touched(st);
+  st->stats.postings += st->strand_hits[0] + st->strand_hits[1];
+  st->stats.words += 2*n_words;
+  st->stats.distinct += st->n_distinct;
 }
 
-static int fasta_scan(uchar *seq, uint seq_id, int length, 
-		      hit_report_t *report_hits) {
-  int i, j, k, f;
-  int n_hits, n_nodes, max, max_span;
-  int min_di, max_di, total_length;
-  wordhit_t *hits;
-  int *adjmatrix;
-  int *pred, *score;
-  int end, start, s_start, s_end;
+/* --diagonal-runs: instead of collecting every word hit and sorting them
+   to find the runs of consecutive words along each diagonal, as 
+   combine_hits() does, word hits are merged into runs as they arrive. As
+   the query is scanned in order of position, the next word of a run on 
+   a diagonal is always the next hit on that diagonal (the previous one 
+   for the reverse strand, which is scanned backwards). Each (target, 
+   strand, diagonal) triple hit by the query has a slot in an open 
+   addressing hash, keyed by 2*target + strand, holding the list of its 
+   runs. Memory scales with the number of runs and
+   diagonals, and only those are sorted. */
+typedef struct diagslot_s {
+  int db_seq;
+  int di;
+  int first, last;
+} diagslot_t;
+
+#define DIAG_EMPTY (-1)
+
+static inline diagslot_t *diagonal_slot(scan_state_t *st, int db_seq, 
+					int di) {
+  diagslot_t *slot;
+  uint h;
+
+  h = ((uint) db_seq*0x9E3779B1U) ^ ((uint) di*0x85EBCA6BU);
+  h ^= h >> 15;
+  slot = st->diag_slots + (h & st->diag_mask);
+  while(slot->first != DIAG_EMPTY && 
+	(slot->db_seq != db_seq || slot->di != di)) {
+    slot = (slot == st->diag_slots + st->diag_mask) ? st->diag_slots : 
+      slot + 1;
+  }
+  return slot;
+}
 
-  
-  hits = find_wordmatches(seq, seq_id, length, &n_hits);
-  if (hits == NULL) return 0;
+/* Doubles the hash, keeping it at most half full */
+static void grow_diagonals(scan_state_t *st) {
+  diagslot_t *old, *slot;
+  uint n_old, k;
+
+  old = st->diag_slots;
+  n_old = old ? st->diag_mask + 1 : 0;
+  st->diag_mask = n_old ? 2*n_old - 1 : 1023;
+  MA(st->diag_slots, sizeof(diagslot_t)*(st->diag_mask + 1));
+  for(k=0;k<=st->diag_mask;k++) st->diag_slots[k].first = DIAG_EMPTY;
+  for(k=0;k<st->n_diags;k++) {
+    slot = diagonal_slot(st, st->diag_keys[k].db_seq, st->diag_keys[k].di);
+    *slot = old[st->diag_keys[k].pos];
+    st->diag_keys[k].pos = slot - st->diag_slots;
+  }
+  free(old);
+}
 
-  wordhit_mergesort(hits, 0, n_hits);
+static inline void add_diagonal_hit(scan_state_t *st, int db_seq, int di,
+				    int pos) {
+  diagslot_t *slot;
+  wordhit_t *run;
+
+  if (2*(st->n_diags + 1) > st->diag_mask + 1) grow_diagonals(st);
+  slot = diagonal_slot(st, db_seq, di);
+  if (slot->first != DIAG_EMPTY) {
+    run = st->runs + slot->last;
+    /* <length> counts words until the runs are handed over. Hits of the 
+       reverse strand (odd keys) arrive in decreasing position. */
+    if (!(db_seq & 1) && pos == run->pos + run->length) {
+      run->length++;
+      return;
+    }
+    if ((db_seq & 1) && pos == run->pos - 1) {
+      run->pos--;
+      run->length++;
+      return;
+    }
+  } else {
+    if (st->n_diags == st->diag_keys_allocsize) {
+      st->diag_keys_allocsize = 2*st->diag_keys_allocsize + 1024;
+      RA(st->diag_keys, st->diag_keys_allocsize, sizeof(wordhit_t));
+    }
+    st->diag_keys[st->n_diags].db_seq = db_seq;
+    st->diag_keys[st->n_diags].di = di;
+    st->diag_keys[st->n_diags].pos = slot - st->diag_slots;
+    st->n_diags++;
+    slot->db_seq = db_seq;
+    slot->di = di;
+    slot->first = DIAG_EMPTY;
+  }
 
-#if 0
-  for(i=0;i<n_hits-1;i++) {
-    if (mergesort_compare(hits + i, hits + i + 1) == 1) {
-      fprintf(stderr,"Out of order!\n");
-      fprintf(stderr,"%d %d %d %d\n",hits[i].db_seq,hits[i].di, hits[i].pos,
-	      hits[i].length);
-      fprintf(stderr,"%d %d %d %d\n",hits[i+1].db_seq,hits[i+1].di, 
-	      hits[i+1].pos, hits[i+1].length);
+  if (st->n_runs == st->runs_allocsize) {
+    st->runs_allocsize = 2*st->runs_allocsize + 1024;
+    RA(st->runs, st->runs_allocsize, sizeof(wordhit_t));
+    RA(st->run_next, st->runs_allocsize, sizeof(int));
+  }
+  run = st->runs + st->n_runs;
+  run->db_seq = db_seq;
+  run->di = di;
+  run->pos = pos;
+  run->length = 1;
+  st->run_next[st->n_runs] = DIAG_EMPTY;
+  if (slot->first == DIAG_EMPTY) {
+    slot->first = st->n_runs;
+  } else {
+    st->run_next[slot->last] = st->n_runs;
+  }
+  slot->last = st->n_runs;
+  st->n_runs++;
+}
 
+/* Hands over the runs collected for the query, for each strand in the 
+   order combine_hits() would give them, by target, diagonal and position,
+   and empties the hash for the next query. Runs of the reverse strand were
+   made in decreasing position, so their lists are read backwards. */
+static void diagonal_runs_list(scan_state_t *st, wordhit_t **return_runs,
+			       int *return_nruns) {
+  wordhit_t *runs[2], *run, tmp;
+  diagslot_t *slot;
+  int k, r, s, f[2], first;
+
+  sort_wordhits(st, st->diag_keys, st->n_diags);
+  runs[0] = arena_alloc(&st->arena, sizeof(wordhit_t)*st->n_runs);
+  runs[1] = arena_alloc(&st->arena, sizeof(wordhit_t)*st->n_runs);
+  f[0] = f[1] = 0;
+  for(k=0;k<st->n_diags;k++) {
+    slot = st->diag_slots + st->diag_keys[k].pos;
+    s = slot->db_seq & 1;
+    first = f[s];
+    if (two_hit_score && 
+	st->hits_byseq[slot->db_seq - 2*(int) ltable_start] == 0) {
+      /* Dropped by --two-hit */
+      slot->first = DIAG_EMPTY;
+      continue;
+    }
+    for(r=slot->first;r!=DIAG_EMPTY;r=st->run_next[r]) {
+      run = runs[s] + f[s]++;
+      *run = st->runs[r];
+      run->db_seq >>= 1;
+      run->length += hit_wordsize - 1;
     }
+    for(r=f[s]-1;s && first<r;first++,r--) {
+      tmp = runs[s][first];
+      runs[s][first] = runs[s][r];
+      runs[s][r] = tmp;
+    }
+    slot->first = DIAG_EMPTY;
   }
-#endif
-  //qsort(hits, n_hits, sizeof(wordhit_t), wordhit_compare);
+  assert(two_hit_score || f[0] + f[1] == st->n_runs);
+  st->n_diags = st->n_runs = 0;
+  for(s=0;s<2;s++) {
+    return_runs[s] = f[s] > 0 ? runs[s] : NULL;
+    return_nruns[s] = f[s];
+  }
+}
 
-  f = combine_hits(hits, n_hits);
+/* Reads sequence <seq_id> of <sdb> into <seq>, and its quality values 
+   into <qual> if a quality file is open and <qual> is not NULL. The files
+   are read with pread() so that threads do not share a file position. */
+static void read_sequence(seqdb_t *sdb, uint seq_id, uchar *seq, 
+			  uchar *qual) {
+  int length;
 
-  max_span = i = j = 0;
-  while(i < f) {
-    while(j < f && hits[i].db_seq == hits[j].db_seq) j++;
-    if ((j - i) > max_span)
-      max_span = j - i;
-    i = j;
+  length = sdb->meta[seq_id].seq_length;
+  if (sdb->store) {
+    memcpy(seq, sdb->store + sdb->meta[seq_id].seqbin_pos, length);
+    if (qual && sdb->qual_store) {
+      memcpy(qual, sdb->qual_store + sdb->meta[seq_id].seqbin_pos, length);
+    }
+    return;
+  }
+  if (pread(sdb->bin_fd, seq, length, sdb->meta[seq_id].seqbin_pos) 
+      != length ||
+      (qual && sdb->qual_fd >= 0 && 
+       pread(sdb->qual_fd, qual, length, sdb->meta[seq_id].seqbin_pos) 
+       != length)) {
+    logmsg(MSG_FATAL,"! Failed reading sequence %u of %s\n", seq_id,
+	   sdb->basename);
   }
+}
 
-  MA(adjmatrix, (max_span + 3)*(max_span + 3)*sizeof(int));
-  MA(pred, sizeof(int)*(max_span + 3));
-  MA(score, sizeof(int)*(max_span + 3));
+/* Scores of the --two-hit extension and of the --verify alignment, those
+   of align_sequences() in pairwise_prescan2.c */
+#define ALIGN_MATCH (2)
+#define ALIGN_MISMATCH (-5)
+#define ALIGN_GAP (-6)
+
+/* --two-hit: a target passing the word count threshold is only chained if
+   two non-overlapping word hits, at most TWO_HIT_WINDOW apart on the query
+   and TWO_HIT_DIAGONALS apart in diagonal, have an ungapped X-drop 
+   extension from the second of them scoring at least two_hit_score. As in
+   BLAST, the last hit of each target and strand is kept, hits overlapping
+   it are ignored, and hits too far from it replace it; every pair found is
+   extended until one passes. Pairs are looked for while the hits of the 
+   targets passing the count are compiled, not while counting, which for 
+   repeats would cost more than it saves; targets made of scattered chance
+   word hits are then dropped before their hits are sorted and chained. */
+#define TWO_HIT_WINDOW (40)
+#define TWO_HIT_DIAGONALS (2)
+#define XDROP (20)
+
+/* Ungapped extension of diagonal <di> both ways from query position 
+   <q_pos>, each way stopping once the score falls XDROP below the best 
+   seen. Returns the sum of the best scores of the two ways. */
+static int xdrop_extend(uchar *q, int q_length, uchar *s, int s_length,
+			int q_pos, int di) {
+  int i, score, right, left;
+
+  score = right = 0;
+  for(i=q_pos;i<q_length && i+di<s_length && right-score <= XDROP;i++) {
+    score += (q[i] == s[i+di]) ? ALIGN_MATCH : ALIGN_MISMATCH;
+    if (score > right) right = score;
+  }
+  score = left = 0;
+  for(i=q_pos-1;i>=0 && i+di>=0 && left-score <= XDROP;i--) {
+    score += (q[i] == s[i+di]) ? ALIGN_MATCH : ALIGN_MISMATCH;
+    if (score > left) left = score;
+  }
+  return left + right;
+}
 
-  n_hits = 0;
-  i = j = 0;
-  while(i < f) {
-    while(j < f && hits[j].db_seq == hits[i].db_seq) j++;
+/* Takes word hit (di, pos) of entry <j> of hits_byseq (2*target + strand)
+   of query <q>, on that strand */
+static inline void two_hit(scan_state_t *st, int j, uchar *q, int length, 
+			   int di, int pos) {
+  twohit_t *th = st->twohit + j;
+  uint target;
+  int d, s_length;
+
+  if (th->passed) return;
+  d = abs(pos - th->last_pos);
+  if (th->last_pos < 0 || d > TWO_HIT_WINDOW || 
+      abs(di - th->last_di) > TWO_HIT_DIAGONALS) {
+    th->last_di = di;
+    th->last_pos = pos;
+    return;
+  }
+  if (d < wordsize) return;
+  th->last_di = di;
+  th->last_pos = pos;
+
+  target = j/2 + ltable_start;
+  s_length = seqmeta[target].seq_length;
+  if (xdrop_extend(q, length, target_db.map + seqmeta[target].seqbin_pos,
+		   s_length, pos, di) >= two_hit_score) {
+    th->passed = 1;
+  }
+}
 
-    n_nodes = single_source_shortest_path(adjmatrix, pred, score, hits, i, j);
+/* Zeroes the counts in hits_byseq of the targets below the count threshold
+   and of those not reported for query <seq_id> (see target_reported()), 
+   and sums the word hits left on each strand in n_hits. Only the blocks 
+   in st->touched are looked at. With SSE2 the counts are tested 8 at a 
+   time, as count >= threshold/2 rounded up, with a saturating subtract as
+   there is no unsigned 16-bit compare; the entries of the two strands
+   alternate, and are summed as the low and high halves of 32-bit lanes.
+   On a strand where a count left saturated, n_hits is the word hits 
+   counted instead, a bound on the hits. */
+static void apply_threshold(scan_state_t *st, uint seq_id, int *n_hits) {
+  unsigned short *h;
+  long long low, first;
+  int i, j, start, sum0, sum1, saturated, passed;
+#ifdef __SSE2__
+  __m128i v, zero, one, min_count, max_count, low_half;
+  __m128i acc0, acc1, acc_passed, acc_saturated;
+  int m, sums[4];
+
+  zero = _mm_setzero_si128();
+  one = _mm_set1_epi16(1);
+  min_count = _mm_set1_epi16((short) (count_threshold > 0 ? 
+				      (count_threshold + 1)/2 : 0));
+  max_count = _mm_set1_epi16((short) COUNT_MAX);
+  low_half = _mm_set1_epi32(0xFFFF);
+  acc0 = acc1 = acc_passed = acc_saturated = zero;
+#else
+  unsigned short c0, c1;
+#endif
 
-    /* Recovery of results from SSSP */
-    max = 0;
-    for(k=1;k<n_nodes;k++) {
-      if (score[k] > score[max]) max = k;
+  /* Entries of the targets before the query are not reported */
+  low = 0;
+  if (query_db == &target_db && seq_id > ltable_start) {
+    low = 2*((long long) seq_id - ltable_start);
+  }
+  sum0 = sum1 = saturated = passed = 0;
+  for(i=0;i<st->n_touched;i++) {
+    first = (long long) COUNT_BLOCK*st->touched[i];
+    h = st->hits_byseq + first;
+    start = 0;
+    if (first < low) {
+      start = (low - first < COUNT_BLOCK) ? low - first : COUNT_BLOCK;
+      memset(h, 0, sizeof(unsigned short)*start);
     }
-    k = max;
-    min_di = hits[i+k-1].di;
-    max_di = hits[i+k-1].di;
-    start = end = hits[i+k-1].pos + hits[i+k-1].length;
-    s_start = s_end = hits[i+k-1].pos + hits[i+k-1].di + hits[i+k-1].length;
-    while(k!=0) {
+#ifdef __SSE2__
+    for(j=0;j<COUNT_BLOCK;j+=8) {
+      v = _mm_loadu_si128((__m128i *) (h + j));
+      v = _mm_and_si128(v, _mm_cmpeq_epi16(_mm_subs_epu16(min_count, v), 
+					   zero));
+      _mm_storeu_si128((__m128i *) (h + j), v);
+      acc0 = _mm_add_epi32(acc0, _mm_and_si128(v, low_half));
+      acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v, 16));
+      /* 1 for each count left, summed in pairs into 32-bit lanes */
+      acc_passed = _mm_add_epi32(acc_passed, _mm_madd_epi16(
+	_mm_add_epi16(_mm_cmpeq_epi16(v, zero), one), one));
+      acc_saturated = _mm_or_si128(acc_saturated, 
+				   _mm_cmpeq_epi16(v, max_count));
+    }
+#else
+    for(j=start;j<COUNT_BLOCK;j+=2) {
+      c0 = (h[j]*2 >= count_threshold) ? h[j] : 0;
+      c1 = (h[j+1]*2 >= count_threshold) ? h[j+1] : 0;
+      h[j] = c0;
+      h[j+1] = c1;
+      sum0 += c0;
+      sum1 += c1;
+      passed += (c0 != 0) + (c1 != 0);
+      saturated |= (c0 == COUNT_MAX) | (c1 == COUNT_MAX) << 1;
+    }
+#endif
+  }
+#ifdef __SSE2__
+  _mm_storeu_si128((__m128i *) sums, acc0);
+  sum0 = sums[0] + sums[1] + sums[2] + sums[3];
+  _mm_storeu_si128((__m128i *) sums, acc1);
+  sum1 = sums[0] + sums[1] + sums[2] + sums[3];
+  _mm_storeu_si128((__m128i *) sums, acc_passed);
+  passed = sums[0] + sums[1] + sums[2] + sums[3];
+  m = _mm_movemask_epi8(acc_saturated);
+  saturated = ((m & 0x3333) != 0) | ((m & 0xCCCC) != 0) << 1;
+#endif
+  n_hits[0] = (saturated & 1) ? st->strand_hits[0] : sum0;
+  n_hits[1] = (saturated & 2) ? st->strand_hits[1] : sum1;
+  st->stats.targets += passed;
+}
+
+/* Compiles the word hits of the targets left in hits_byseq into hits[s], 
+   or into runs with --diagonal-runs, counting them in t[s]. This goes 
+   through the query in order of position, as --diagonal-runs and --two-hit
+   need, reading the postings of every word. The first word of a sequence
+   is at position 0, as is the second, and every later word is at the 
+   position before its first base. */
+static void compile_by_position(scan_state_t *st, uchar *seq, int length, 
+				int n_words, int *n_hits, wordhit_t **hits, 
+				int *t) {
+  unsigned short *hits_byseq = st->hits_byseq;
+  queryword_t *words = st->words;
+  word_t *postings;
+  int i,j,k,n,p,pos,rc_pos;
+
+  for(p=0;p<n_words;p++) {
+    if (prefetch_distance) {
+      prefetch_ahead(words, n_words, p, (n_hits[0] > 0) | (n_hits[1] > 0)<<1);
+    }
+    i = words[p].i;
+    pos = (i == wordsize - 1) ? 0 : i - wordsize;
+    rc_pos = (i == length - 1) ? 0 : length - 2 - i;
+
+    n = 0;
+    if (n_hits[0]) postings = word_postings(st, words[p].word, &n);
+    for(j=0;j<n;j++) {
+      k = 2*(postings[j].seq_id - ltable_start);
+      if (hits_byseq[k] == 0) continue;
+      if (two_hit_score) {
+	two_hit(st, k, seq, length, postings[j].seq_pos - pos, pos);
+      }
+      if (diagonal_runs) {
+	add_diagonal_hit(st, 2*postings[j].seq_id, 
+			 postings[j].seq_pos - pos, pos);
+      } else {
+	hits[0][t[0]].db_seq = postings[j].seq_id;
+	hits[0][t[0]].di = postings[j].seq_pos - pos;
+	hits[0][t[0]].pos = pos;
+      }
+      t[0]++;
+    }
+    n = 0;
+    if (n_hits[1]) postings = word_postings(st, words[p].rc_word, &n);
+    for(j=0;j<n;j++) {
+      k = 2*(postings[j].seq_id - ltable_start) + 1;
+      if (hits_byseq[k] == 0) continue;
+      if (two_hit_score) {
+	two_hit(st, k, st->rc_seq, length, postings[j].seq_pos - rc_pos, 
+		rc_pos);
+      }
+      if (diagonal_runs) {
+	add_diagonal_hit(st, 2*postings[j].seq_id + 1, 
+			 postings[j].seq_pos - rc_pos, rc_pos);
+      } else {
+	hits[1][t[1]].db_seq = postings[j].seq_id;
+	hits[1][t[1]].di = postings[j].seq_pos - rc_pos;
+	hits[1][t[1]].pos = rc_pos;
+      }
+      t[1]++;
+    }
+  }
+}
+
+/* Compiles the word hits of the targets left in hits_byseq into hits[s], 
+   counting them in t[s], without regard to order, as they are sorted 
+   next. The postings of each distinct word are read once, and hits made
+   from them for every occurrence of the word in the query. */
+static void compile_by_word(scan_state_t *st, int *n_hits, wordhit_t **hits, 
+			    int *t) {
+  unsigned short *hits_byseq = st->hits_byseq;
+  distinctword_t *d = st->distinct;
+  word_t *postings;
+  int *occ;
+  int j,k,n,o,p,s,pos,m;
+
+  for(p=0;p<st->n_distinct;p++) {
+    if (prefetch_distance) prefetch_distinct(d, st->n_distinct, p);
+    if ((n_hits[0] == 0 || d[p].n[0] == 0) && 
+	(n_hits[1] == 0 || d[p].n[1] == 0)) continue;
+    postings = word_postings(st, d[p].word, &n);
+    occ = st->occurrences + d[p].start;
+    m = d[p].n[0] + d[p].n[1];
+    for(j=0;j<n;j++) {
+      k = 2*(postings[j].seq_id - ltable_start);
+      if ((hits_byseq[k] | hits_byseq[k+1]) == 0) continue;
+      for(o=0;o<m;o++) {
+	s = occ[o] & 1;
+	if (hits_byseq[k + s] == 0) continue;
+	pos = occ[o] >> 1;
+	hits[s][t[s]].db_seq = postings[j].seq_id;
+	hits[s][t[s]].di = postings[j].seq_pos - pos;
+	hits[s][t[s]].pos = pos;
+	t[s]++;
+      }
+    }
+  }
+}
+
+/* Finds the word hits of both strands of a query in one pass. The word
+   ending at each position is rolled forward together with its reverse 
+   complement, which is the word of the reverse complemented query 
+   starting length - 1 - i, and both are looked up. Hits of the reverse
+   strand are in the coordinates of the reverse complemented query, as if
+   it had been scanned on its own. Counts are kept per target and strand
+   in hits_byseq[2*target + strand].
+
+   The hits of strand s are returned in return_hits[s], allocated in the
+   arena, or NULL if there are none. */
+static void find_wordmatches(scan_state_t *st, uchar *seq, uchar *qual,
+			     uint seq_id, int length, wordhit_t **return_hits,
+			     int *return_nhits) {
+  unsigned short *hits_byseq = st->hits_byseq;
+  int n_hits[2], t[2];
+  int i,j,k,s,n_words;
+  wordhit_t *hits[2];
+  
+  /* This implements a censoring technique to speed the execution of the 
+     program, by excluding spurious word matches to sequences (which would
+     trigger a single-source shortest path analysis) that can not in total
+     reach the output threshold. Also, by excluding these words from the
+     list of word hits, the sorting time for combining the word hits is also
+     reduced. */
+  clear_counts(st);
+  return_hits[0] = return_hits[1] = NULL;
+  return_nhits[0] = return_nhits[1] = 0;
+  if (length < wordsize) return;
+  
+  n_words = gather_words(st, seq, qual, length);
+  count_wordhits(st, n_words, length);
+  stage_done(st, STAGE_LOOKUP);
+
+  if (fine_words) {
+    return_hits[0] = refine_wordmatches(st, seq, qual, seq_id, length, 0, 
+					return_nhits);
+    reverse_complement(st->rc_seq, seq, length);
+    if (qual) reverse_quality(st->rc_qual, qual, length);
+    return_hits[1] = refine_wordmatches(st, st->rc_seq, 
+					qual ? st->rc_qual : NULL, seq_id, 
+					length, 1, return_nhits + 1);
+    return;
+  }
+
+  apply_threshold(st, seq_id, n_hits);
+  stage_done(st, STAGE_FILTER);
+  if (n_hits[0] + n_hits[1] == 0) return;
+  if (two_hit_score) reverse_complement(st->rc_seq, seq, length);
+  hits[0] = hits[1] = NULL;
+  if (diagonal_runs) {
+    if (st->diag_slots == NULL) grow_diagonals(st);
+  } else {
+    for(s=0;s<2;s++) {
+      if (n_hits[s] > 0) {
+	hits[s] = arena_alloc(&st->arena, n_hits[s]*sizeof(wordhit_t));
+      }
+    }
+  }
+  
+  t[0] = t[1] = 0;
+  if (diagonal_runs || two_hit_score) {
+    compile_by_position(st, seq, length, n_words, n_hits, hits, t);
+  } else {
+    compile_by_word(st, n_hits, hits, t);
+  }
+  /* Equal unless a count saturated */
+  assert(t[0] <= n_hits[0] && t[1] <= n_hits[1]);
+  n_hits[0] = t[0];
+  n_hits[1] = t[1];
+  st->stats.hits += t[0] + t[1];
+
+  if (two_hit_score) {
+    for(i=0;i<COUNT_BLOCK*st->n_touched;i++) {
+      j = COUNT_BLOCK*st->touched[i/COUNT_BLOCK] + i%COUNT_BLOCK;
+      if (hits_byseq[j] == 0) continue;
+      if (!st->twohit[j].passed) {
+	hits_byseq[j] = 0;
+	st->two_hit_rejects++;
+      }
+      st->twohit[j].last_pos = -1;
+      st->twohit[j].passed = 0;
+    }
+    for(s=0;s<2 && !diagonal_runs;s++) {
+      for(i=k=0;i<n_hits[s];i++) {
+	if (hits_byseq[2*(hits[s][i].db_seq - ltable_start) + s]) {
+	  hits[s][k++] = hits[s][i];
+	}
+      }
+      n_hits[s] = k;
+      if (k == 0) hits[s] = NULL;
+    }
+  }
+
+  if (diagonal_runs) {
+    diagonal_runs_list(st, return_hits, return_nhits);
+    return;
+  }
+  for(s=0;s<2;s++) {
+    return_hits[s] = hits[s];
+    return_nhits[s] = n_hits[s];
+  }
+}
+
+/* Query buffers of st are sized for the longest query read so far */
+static void grow_query_buffers(scan_state_t *st, int length) {
+
+  if (length > st->seqsize) {
+    st->seqsize = length;
+    RA(st->seq, st->seqsize, sizeof(uchar));
+    RA(st->qual, st->seqsize, sizeof(uchar));
+    RA(st->rc_seq, st->seqsize, sizeof(uchar));
+    RA(st->rc_qual, st->seqsize, sizeof(uchar));
+  }
+}
+
+/* --batch: the queries of a block are scanned together. The words of both
+   strands of every query of the block are gathered, with the query, strand
+   and position they come from, and sorted by word; the postings of each 
+   word are then read once for all the queries using it, walking the table
+   in order instead of chasing the postings of each query's words all over
+   it. The hits are scattered to a slice of batch_hits for each query and
+   strand, from which batch_wordmatches() counts, filters and returns the
+   hits of each query as find_wordmatches() would. Memory grows with the 
+   word hits of a whole block, before the count threshold is applied. */
+/* Gathers the words of queries <first> to <end> - 1, read into 
+   st->batch_seq, and scatters their hits */
+static void scan_batch(scan_state_t *st, uint first, uint end) {
+  unsigned long long *keys, all_or, all_and;
+  batchentry_t *e;
+  uchar *seq, *qual;
+  word_t **postings, *p;
+  int *n_postings;
+  size_t *offsets, n_total, prev, t;
+  uint word, rc_word, q;
+  int i, j, a, b, n, n_words, length, last_low, rc_shift, n_refs;
+
+  n_refs = 2*(end - first);
+  st->batch_first = first;
+  offsets = st->batch_offsets;
+
+  /* Read the queries */
+  st->batch_seq_offsets[0] = 0;
+  for(q=first;q<end;q++) {
+    st->batch_seq_offsets[q - first + 1] = 
+      st->batch_seq_offsets[q - first] + query_db->meta[q].seq_length;
+  }
+  if (st->batch_seq_offsets[end - first] > st->batch_seqsize) {
+    st->batch_seqsize = st->batch_seq_offsets[end - first];
+    RA(st->batch_seq, st->batch_seqsize, sizeof(uchar));
+    RA(st->batch_qual, st->batch_seqsize, sizeof(uchar));
+  }
+  n = 0;
+  for(q=first;q<end;q++) {
+    read_sequence(query_db, q, 
+		  st->batch_seq + st->batch_seq_offsets[q - first], 
+		  st->batch_qual + st->batch_seq_offsets[q - first]);
+    grow_query_buffers(st, query_db->meta[q].seq_length);
+    if (query_db->meta[q].seq_length >= wordsize) {
+      n += 2*(query_db->meta[q].seq_length - wordsize + 1);
+    }
+  }
+
+  /* Gather the words of both strands, keyed by word in the high 32 bits
+     and by entry in the low ones */
+  if (n > st->batch_allocsize) {
+    st->batch_allocsize = n;
+    RA(st->batch_keys, st->batch_allocsize, sizeof(unsigned long long));
+    RA(st->batch_scratch, st->batch_allocsize, sizeof(unsigned long long));
+    RA(st->batch_entries, st->batch_allocsize, sizeof(batchentry_t));
+    RA(st->batch_postings, st->batch_allocsize, sizeof(word_t *));
+    RA(st->batch_npostings, st->batch_allocsize, sizeof(int));
+  }
+  keys = st->batch_keys;
+  e = st->batch_entries;
+  rc_shift = 2*(wordsize - 1);
+  all_or = 0;
+  all_and = ~0ULL;
+  n = 0;
+  for(q=first;q<end;q++) {
+    seq = st->batch_seq + st->batch_seq_offsets[q - first];
+    qual = (query_db->qual_fd >= 0) ? 
+      st->batch_qual + st->batch_seq_offsets[q - first] : NULL;
+    length = query_db->meta[q].seq_length;
+    last_low = -1;
+    word = rc_word = 0;
+    for(i=0;i<length;i++) {
+      word = ((word << 2) & mask) | seq[i];
+      rc_word = (rc_word >> 2) | ((uint) (seq[i] ^ 0x3) << rc_shift);
+      if (qual && qual[i] < min_quality) last_low = i;
+      if (i < wordsize - 1) continue;
+      if (i - last_low < wordsize) {
+	st->skipped_words += 2;
+	continue;
+      }
+      e[n].ref = 2*(q - first);
+      e[n].pos = (i == wordsize - 1) ? 0 : i - wordsize;
+      keys[n] = ((unsigned long long) word << 32) | n;
+      all_or |= keys[n];
+      all_and &= keys[n];
+      n++;
+      e[n].ref = 2*(q - first) + 1;
+      e[n].pos = (i == length - 1) ? 0 : length - 2 - i;
+      keys[n] = ((unsigned long long) rc_word << 32) | n;
+      all_or |= keys[n];
+      all_and &= keys[n];
+      n++;
+    }
+  }
+  st->stats.words += n;
+  /* Stable on the word alone, so that the entries of a word stay in order */
+  keys = radix_sort_keys(keys, st->batch_scratch, n, all_or ^ all_and, 32, 
+			 32 + 2*wordsize);
+
+  /* Look each word up once, and size the slices */
+  postings = st->batch_postings;
+  n_postings = st->batch_npostings;
+  for(j=0;j<=n_refs;j++) offsets[j] = 0;
+  n_words = 0;
+  for(a=0;a<n;a=b) {
+    word = (uint) (keys[a] >> 32);
+    for(b=a+1;b<n && (uint) (keys[b] >> 32) == word;b++);
+    postings[n_words] = word_postings(st, word, n_postings + n_words);
+    st->stats.postings += (double) (b - a)*n_postings[n_words];
+    st->stats.walked += n_postings[n_words];
+    for(j=a;j<b;j++) {
+      offsets[e[(uint) keys[j]].ref + 1] += n_postings[n_words];
+    }
+    n_words++;
+  }
+  st->stats.distinct += n_words;
+  for(j=0;j<n_refs;j++) offsets[j+1] += offsets[j];
+  n_total = offsets[n_refs];
+  if (n_total > st->batch_hits_allocsize) {
+    st->batch_hits_allocsize = n_total;
+    RA(st->batch_hits, st->batch_hits_allocsize, sizeof(wordhit_t));
+  }
+
+  /* Scatter the hits, walking the postings in table order */
+  n_words = 0;
+  for(a=0;a<n;a=b) {
+    word = (uint) (keys[a] >> 32);
+    for(b=a+1;b<n && (uint) (keys[b] >> 32) == word;b++);
+    p = postings[n_words];
+    for(j=a;j<b;j++) {
+      batchentry_t *x = e + (uint) keys[j];
+      wordhit_t *h = st->batch_hits + offsets[x->ref];
+
+      for(i=0;i<n_postings[n_words];i++) {
+	h[i].db_seq = p[i].seq_id;
+	h[i].di = p[i].seq_pos - x->pos;
+	h[i].pos = x->pos;
+      }
+      offsets[x->ref] += n_postings[n_words];
+    }
+    n_words++;
+  }
+  /* offsets[ref] now ends slice ref */
+  prev = 0;
+  for(j=0;j<n_refs;j++) {
+    t = offsets[j];
+    offsets[j] = prev;
+    prev = t;
+  }
+  offsets[n_refs] = n_total;
+}
+
+/* The hits of query <seq_id> of the block gathered by scan_batch(), 
+   counted and filtered as find_wordmatches() does. The hits passing are 
+   moved to the front of the query's slices, and returned there. */
+static void batch_wordmatches(scan_state_t *st, uint seq_id, 
+			      wordhit_t **return_hits, int *return_nhits) {
+  unsigned short *hits_byseq = st->hits_byseq, c;
+  wordhit_t *h;
+  int n_hits[2], i, k, n, s, ref;
+
+  clear_counts(st);
+  ref = 2*(seq_id - st->batch_first);
+  for(s=0;s<2;s++) {
+    h = st->batch_hits + st->batch_offsets[ref + s];
+    n = st->batch_offsets[ref + s + 1] - st->batch_offsets[ref + s];
+    st->strand_hits[s] = n;
+    for(i=0;i<n;i++) {
+      k = 2*(h[i].db_seq - ltable_start) + s;
+      c = hits_byseq[k];
+      hits_byseq[k] = c + (c < COUNT_MAX);
+      if (st->block_touched) st->block_touched[k/COUNT_BLOCK] = 1;
+    }
+  }
+  list_touched(st);
+  apply_threshold(st, seq_id, n_hits);
+  for(s=0;s<2;s++) {
+    h = st->batch_hits + st->batch_offsets[ref + s];
+    n = st->batch_offsets[ref + s + 1] - st->batch_offsets[ref + s];
+    for(i=k=0;i<n && k<n_hits[s];i++) {
+      if (hits_byseq[2*(h[i].db_seq - ltable_start) + s]) h[k++] = h[i];
+    }
+    return_hits[s] = k > 0 ? h : NULL;
+    return_nhits[s] = k;
+    st->stats.hits += k;
+  }
+}
+
+/* Word hits of a query, from the block gathered by scan_batch() with 
+   --batch, or by find_wordmatches() */
+static void query_wordmatches(scan_state_t *st, uchar *seq, uchar *qual,
+			      uint seq_id, int length, 
+			      wordhit_t **return_hits, int *return_nhits) {
+  if (batch) {
+    batch_wordmatches(st, seq_id, return_hits, return_nhits);
+  } else {
+    find_wordmatches(st, seq, qual, seq_id, length, return_hits, 
+		     return_nhits);
+  }
+}
+
+static int combine_hits(wordhit_t *hits, int n_hits) {
+  int i,j,f;
+
+  f = i = j = 0;
+  while(i < n_hits) {
+    while(j < n_hits                       && 
+	  hits[i].db_seq == hits[j].db_seq &&
+	  hits[i].di == hits[j].di         && 
+	  hits[j].pos - hits[i].pos == j - i) j++;
+    hits[f].di = hits[i].di;
+    hits[f].db_seq = hits[i].db_seq;
+    hits[f].pos = hits[i].pos;
+    hits[f].length = j - i + hit_wordsize - 1;
+    f++;
+    i = j;
+  }
+
+
+  return f;
+}
+
+static int run_bypos_compare(const void *c, const void *d) {
+  const wordhit_t *a = c, *b = d;
+
+  if (a->pos != b->pos) return a->pos < b->pos ? -1 : 1;
+  if (a->di != b->di) return a->di < b->di ? -1 : 1;
+  return 0;
+}
+
+/* Max-trees over the runs of a target in order of diagonal, used by 
+   chain_runs(). Each node holds the best value of its leaves, and the 
+   earliest run giving it. */
+typedef struct {
+  int value;
+  int run;
+} chainnode_t;
+
+static inline int chainnode_better(chainnode_t *a, chainnode_t *b) {
+  return a->value > b->value || (a->value == b->value && a->run < b->run);
+}
+
+static void chaintree_set(chainnode_t *tree, int n_leaves, int leaf, 
+			  int value, int run) {
+  int k;
+
+  k = leaf + n_leaves;
+  tree[k].value = value;
+  tree[k].run = run;
+  for(k/=2;k>0;k/=2) {
+    tree[k] = chainnode_better(tree + 2*k + 1, tree + 2*k) ? 
+      tree[2*k + 1] : tree[2*k];
+  }
+}
+
+/* Best leaf in [s, e) */
+static chainnode_t chaintree_max(chainnode_t *tree, int n_leaves, 
+				 int s, int e) {
+  chainnode_t best;
+
+  best.value = INT_MIN;
+  best.run = INT_MAX;
+  for(s+=n_leaves, e+=n_leaves;s<e;s/=2, e/=2) {
+    if ((s & 1) && chainnode_better(tree + s, &best)) best = tree[s];
+    if (s & 1) s++;
+    if ((e & 1) && chainnode_better(tree + e - 1, &best)) best = tree[e-1];
+  }
+  return best;
+}
+
+/* A run and the diagonal or end position it is ordered by */
+typedef struct {
+  int key;
+  int run;
+} chainkey_t;
+
+typedef struct {
+  chainkey_t *bydi, *byend;
+  int *rank, *di_end;
+  chainnode_t *trees;
+} chainspace_t;
+
+static int chainkey_compare(const void *c, const void *d) {
+  const chainkey_t *x = c, *y = d;
+
+  if (x->key != y->key) return x->key < y->key ? -1 : 1;
+  return x->run < y->run ? -1 : (x->run > y->run);
+}
+
+/* Best chains ending at each of the n runs, sorted by position, by
+   comparing every pair of runs. See chain_runs(). */
+static void chain_direct(int *pred, int *score, wordhit_t *runs, int n) {
+  int k, l, s, best, best_run;
+
+  for(l=0;l<n;l++) {
+    best = 0;
+    best_run = -1;
+    for(k=0;k<l && runs[k].pos < runs[l].pos;k++) {
+      s = score[k+1] - abs(runs[k].di - runs[l].di) - 
+	abs(runs[k].pos + runs[k].length - runs[l].pos);
+      if (s > best) {
+	best = s;
+	best_run = k;
+      }
+    }
+    score[l+1] = best + runs[l].length - 1;
+    pred[l+1] = best_run + 1;
+  }
+}
+
+/* Same as chain_direct(), in O(n log n). Runs are processed in order of
+   position. Those that end at or before the current position are 
+   "closed", the others that started before it "open", and with the 
+   diagonal on either side of the current run this makes four cases, in 
+   each of which the best predecessor maximizes a term of its own. Each 
+   case is a max-tree indexed by diagonal. */
+static void chain_sparse(chainspace_t *cs, int *pred, int *score, 
+			 wordhit_t *runs, int n) {
+  chainnode_t *closed_lo, *closed_hi, *open_lo, *open_hi, c, best;
+  int m, k, l, g, e, p, base, end_k;
+
+  for(m=1;m<n;m*=2);
+  for(k=0;k<n;k++) {
+    cs->bydi[k].key = runs[k].di;
+    cs->byend[k].key = runs[k].pos + runs[k].length;
+    cs->bydi[k].run = cs->byend[k].run = k;
+  }
+  qsort(cs->bydi, n, sizeof(chainkey_t), chainkey_compare);
+  qsort(cs->byend, n, sizeof(chainkey_t), chainkey_compare);
+  /* rank: leaf of each run. di_end: first leaf with a greater diagonal. */
+  for(k=0;k<n;k=g) {
+    for(g=k;g<n && cs->bydi[g].key == cs->bydi[k].key;g++) 
+      cs->rank[cs->bydi[g].run] = g;
+    for(l=k;l<g;l++) cs->di_end[cs->bydi[l].run] = g;
+  }
+  closed_lo = cs->trees;
+  closed_hi = closed_lo + 2*m;
+  open_lo = closed_hi + 2*m;
+  open_hi = open_lo + 2*m;
+  for(k=0;k<8*m;k++) {
+    cs->trees[k].value = INT_MIN;
+    cs->trees[k].run = INT_MAX;
+  }
+
+  e = 0;
+  for(k=0;k<n;k=g) {
+    p = runs[k].pos;
+    /* Open runs ending at or before p are now closed */
+    for(;e<n;e++) {
+      l = cs->byend[e].run;
+      end_k = cs->byend[e].key;
+      if (end_k > p) break;
+      chaintree_set(open_lo, m, cs->rank[l], INT_MIN, INT_MAX);
+      chaintree_set(open_hi, m, cs->rank[l], INT_MIN, INT_MAX);
+      chaintree_set(closed_lo, m, cs->rank[l], 
+		    score[l+1] + runs[l].di + end_k, l);
+      chaintree_set(closed_hi, m, cs->rank[l], 
+		    score[l+1] - runs[l].di + end_k, l);
+    }
+
+    for(g=k;g<n && runs[g].pos == p;g++) {
+      /* Every term below is the score of run g through the predecessor,
+	 less the length of g and plus one: 0 for the source, which is only
+	 replaced by a strictly better predecessor */
+      best.value = 0;
+      best.run = -1;
+      c = chaintree_max(closed_lo, m, 0, cs->di_end[g]);
+      if (c.value != INT_MIN) {
+	c.value -= runs[g].di + p;
+	if (chainnode_better(&c, &best)) best = c;
+      }
+      c = chaintree_max(closed_hi, m, cs->di_end[g], n);
+      if (c.value != INT_MIN) {
+	c.value += runs[g].di - p;
+	if (chainnode_better(&c, &best)) best = c;
+      }
+      c = chaintree_max(open_lo, m, 0, cs->di_end[g]);
+      if (c.value != INT_MIN) {
+	c.value += p - runs[g].di;
+	if (chainnode_better(&c, &best)) best = c;
+      }
+      c = chaintree_max(open_hi, m, cs->di_end[g], n);
+      if (c.value != INT_MIN) {
+	c.value += p + runs[g].di;
+	if (chainnode_better(&c, &best)) best = c;
+      }
+      score[g+1] = best.value + runs[g].length - 1;
+      pred[g+1] = best.run + 1;
+    }
+
+    /* Runs starting at p are open from p + 1 on */
+    for(l=k;l<g;l++) {
+      base = score[l+1] - (runs[l].pos + runs[l].length);
+      chaintree_set(open_lo, m, cs->rank[l], base + runs[l].di, l);
+      chaintree_set(open_hi, m, cs->rank[l], base - runs[l].di, l);
+    }
+  }
+}
+
+/* Sparse dynamic programming version of a single-source shortest path over
+   the runs hits[i..j) of one target, giving the same chains. Runs are 
+   sorted by position; run l can follow run k when k starts before it, at
+   a cost of the diagonal shift plus the gap or overlap between the end of
+   k and the start of l, plus one. A chain scores the total length of its
+   runs less these costs. Ties go to the earliest run in position order,
+   and the source wins over any predecessor only reaching its score, as in
+   the adjacency matrix version this replaces.
+
+   Targets with few runs, by far the most common, are chained by 
+   chain_direct(), which is cheaper below CHAIN_DIRECT_RUNS, and the others
+   by chain_sparse(), in O(n log n) time and linear memory.
+
+   Fills pred[] and score[]: node 0 is the source, node k the k-th run by
+   position and node j-i+1 the sink. Returns the number of nodes. */
+#define CHAIN_DIRECT_RUNS (64)
+static int chain_runs(chainspace_t *cs, int *pred, int *score,
+		      wordhit_t *hits, int i, int j) {
+  wordhit_t *runs;
+  int n, k;
+
+  runs = hits + i;
+  n = j - i;
+  qsort(runs, n, sizeof(wordhit_t), run_bypos_compare);
+  pred[0] = -1;
+  score[0] = 0;
+  if (n <= CHAIN_DIRECT_RUNS) {
+    chain_direct(pred, score, runs, n);
+  } else {
+    chain_sparse(cs, pred, score, runs, n);
+  }
+
+  /* Sink */
+  score[n+1] = score[1];
+  pred[n+1] = 1;
+  for(k=2;k<=n;k++) {
+    if (score[k] > score[n+1]) {
+      score[n+1] = score[k];
+      pred[n+1] = k;
+    }
+  }
+
+  return n + 2;
+}
+
+/* --max-targets: st->best is a heap of the chains kept, with the worst at
+   the root. Chains are worse for a lower score, or on a tie for a later 
+   target, so that the targets kept are those listed first by a full scan
+   among the equal scores. */
+static inline int report_worse(hit_report_t *a, hit_report_t *b) {
+  return a->score < b->score || 
+    (a->score == b->score && a->db_seq > b->db_seq);
+}
+
+static void best_sift_down(int *best, int n, hit_report_t *report_hits, 
+			   int k) {
+  int c, t;
+
+  for(;(c = 2*k + 1) < n;k=c) {
+    if (c + 1 < n && 
+	report_worse(report_hits + best[c+1], report_hits + best[c])) c++;
+    if (!report_worse(report_hits + best[c], report_hits + best[k])) break;
+    t = best[k];
+    best[k] = best[c];
+    best[c] = t;
+  }
+}
+
+static void best_sift_up(int *best, hit_report_t *report_hits, int k) {
+  int p, t;
+
+  for(;k > 0;k=p) {
+    p = (k - 1)/2;
+    if (!report_worse(report_hits + best[k], report_hits + best[p])) break;
+    t = best[k];
+    best[k] = best[p];
+    best[p] = t;
+  }
+}
+
+static int report_bytarget_compare(const void *c, const void *d) {
+  const hit_report_t *a = c, *b = d;
+
+  return a->db_seq < b->db_seq ? -1 : (a->db_seq > b->db_seq);
+}
+
+/* Chains the runs of each database sequence with chain_runs(). The <f>
+   runs are in order of database sequence, diagonal and position. Chains
+   scoring at least SCORE_THRESHOLD are stored in <report_hits>, in order of
+   database sequence. Returns the number of chains reported.
+
+   With --max-targets only the best max_targets chains are kept. Once that
+   many are held, a target is not chained at all when its runs can not 
+   beat the worst of them: a chain scores the length less one of its runs
+   less nonnegative costs, and can not score more than the <length> of the
+   query since its runs start in increasing order of position. */
+static int chain_hit_runs(scan_state_t *st, wordhit_t *hits, int f, 
+			  int length, hit_report_t *report_hits) {
+  int i, j, k, n_hits, bound, r;
+  int n_nodes, max, max_span;
+  int min_di, max_di, total_length;
+  chainspace_t cs;
+  int *pred, *score;
+  int end, start, s_start, s_end;
+
+  max_span = i = j = 0;
+  while(i < f) {
+    while(j < f && hits[i].db_seq == hits[j].db_seq) j++;
+    if ((j - i) > max_span)
+      max_span = j - i;
+    i = j;
+  }
+
+  for(k=1;k<max_span;k*=2);
+  cs.bydi = arena_alloc(&st->arena, sizeof(chainkey_t)*(max_span + 1));
+  cs.rank = arena_alloc(&st->arena, sizeof(int)*(max_span + 1));
+  cs.di_end = arena_alloc(&st->arena, sizeof(int)*(max_span + 1));
+  cs.byend = arena_alloc(&st->arena, sizeof(chainkey_t)*(max_span + 1));
+  cs.trees = arena_alloc(&st->arena, sizeof(chainnode_t)*8*k);
+  pred = arena_alloc(&st->arena, sizeof(int)*(max_span + 3));
+  score = arena_alloc(&st->arena, sizeof(int)*(max_span + 3));
+
+  n_hits = 0;
+  i = j = 0;
+  while(i < f) {
+    while(j < f && hits[j].db_seq == hits[i].db_seq) j++;
+
+    if (max_targets && n_hits == max_targets) {
+      bound = 0;
+      for(k=i;k<j;k++) bound += hits[k].length - 1;
+      if (bound > length) bound = length;
+      if (bound <= report_hits[st->best[0]].score) {
+	st->pruned_targets++;
+	i = j;
+	continue;
+      }
+    }
+
+    n_nodes = chain_runs(&cs, pred, score, hits, i, j);
+    st->stats.chain_nodes += n_nodes;
+
+    /* Recovery of the best chain */
+    max = 0;
+    for(k=1;k<n_nodes;k++) {
+      if (score[k] > score[max]) max = k;
+    }
+    k = max;
+    min_di = hits[i+k-1].di;
+    max_di = hits[i+k-1].di;
+    start = end = hits[i+k-1].pos + hits[i+k-1].length;
+    s_start = s_end = hits[i+k-1].pos + hits[i+k-1].di + hits[i+k-1].length;
+    while(k!=0) {
       total_length += hits[i+k-1].length;
       if (hits[i+k-1].di < min_di) {
 	min_di = hits[i+k-1].di;
@@ -426,102 +2094,1035 @@ static int fasta_scan(uchar *seq, uint seq_id, int length,
       k = pred[k];
     }
 
-    /* Arbitrary selection of results to report */
-    if (score[max] >= SCORE_THRESHOLD) {
-      report_hits[n_hits].db_seq = hits[i].db_seq;
-      report_hits[n_hits].min_di = min_di - 5;
-      report_hits[n_hits].max_di = max_di + 5;
-      report_hits[n_hits].score = score[max];
-      report_hits[n_hits].start = start;
-      report_hits[n_hits].end = end;
-      report_hits[n_hits].s_start = s_start;
-      report_hits[n_hits].s_end = s_end;
-      n_hits++;
-    }
+    /* Arbitrary selection of results to report */
+    if (score[max] >= SCORE_THRESHOLD) {
+      r = n_hits;
+      if (max_targets && n_hits == max_targets) {
+	r = st->best[0];
+	/* Later target, so it must score higher */
+	if (score[max] <= report_hits[r].score) {
+	  i = j;
+	  continue;
+	}
+      }
+      report_hits[r].db_seq = hits[i].db_seq;
+      report_hits[r].min_di = min_di - 5;
+      report_hits[r].max_di = max_di + 5;
+      report_hits[r].score = score[max];
+      report_hits[r].start = start;
+      report_hits[r].end = end;
+      report_hits[r].s_start = s_start;
+      report_hits[r].s_end = s_end;
+      if (max_targets == 0) {
+	n_hits++;
+      } else if (r == n_hits) {
+	st->best[n_hits++] = r;
+	best_sift_up(st->best, report_hits, n_hits - 1);
+      } else {
+	best_sift_down(st->best, n_hits, report_hits, 0);
+      }
+    }
+
+    i = j;
+  }
+  if (max_targets) {
+    qsort(report_hits, n_hits, sizeof(hit_report_t), 
+	  report_bytarget_compare);
+  }
+  return n_hits;
+}
+
+/* Sorts and combines word hits into runs along each diagonal, and chains
+   them with chain_hit_runs() */
+static int chain_wordhits(scan_state_t *st, wordhit_t *hits, int n_hits, 
+			  int length, hit_report_t *report_hits) {
+  int f;
+
+  sort_wordhits(st, hits, n_hits);
+  stage_done(st, STAGE_SORT);
+  f = combine_hits(hits, n_hits);
+  st->stats.runs += f;
+  stage_done(st, STAGE_COMBINE);
+  n_hits = chain_hit_runs(st, hits, f, length, report_hits);
+  stage_done(st, STAGE_CHAIN);
+  return n_hits;
+}
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+static void print_hits(scan_state_t *st, uint seq_id, int length, 
+		       int n_hits, int strand) {
+  hit_report_t *report_hits = st->report_hits;
+  int j;
+
+  for(j=0;j<n_hits;j++) {
+    int db_seq, start, end, s_start, s_end, s_length, discount, score;
+
+    db_seq = report_hits[j].db_seq;
+    start = report_hits[j].start;
+    end = report_hits[j].end;
+    s_start = report_hits[j].s_start;
+    s_end = report_hits[j].s_end;
+    s_length = seqmeta[db_seq].seq_length;
+    score = report_hits[j].score;
+
+    discount = MIN(start, s_start) + MIN(length - end - 1, s_length - s_end - 1);
+    if (binary_output) {
+      hit_record_t h;
+
+      h.query = seq_id;
+      h.target = db_seq;
+      h.score = score;
+      h.discount = discount;
+      h.q_length = length;
+      h.s_length = s_length;
+      h.start = start;
+      h.end = end;
+      h.s_start = s_start;
+      h.s_end = s_end;
+      h.strand = strand;
+      out_write(st, &h, sizeof(hit_record_t));
+      if (verify) {
+	out_write(st, &report_hits[j].alignment, sizeof(hit_alignment_t));
+      }
+      continue;
+    }
+    out_printf(st,"%u %u %d %d %d %d %d %d %d %d %d",seq_id,db_seq,score,
+	       discount,score-discount,length,s_length, start, end, 
+	       s_start, s_end);
+    if (verify) {
+      hit_alignment_t *a = &report_hits[j].alignment;
+
+      out_printf(st," %.1f %d %d %d %d %d", 100.0*a->matches/a->length, 
+		 a->length, a->q_start, a->q_end, a->s_start, a->s_end);
+    }
+    out_printf(st,"%s\n", strand ? " RC" : "");
+  }
+}
+
+/* Reads query <seq_id> into st->seq (and st->qual) */
+static int read_query(scan_state_t *st, uint seq_id) {
+  int length;
+
+  length = query_db->meta[seq_id].seq_length;
+  grow_query_buffers(st, length);
+  read_sequence(query_db, seq_id, st->seq, st->qual);
+  return length;
+}
+
+/* --verify: banded local alignment of query <q> and target <s> between 
+   diagonals min_di and max_di (target position - query position), those 
+   of the chain widened as hit_report_t has them. Scores and linear gap
+   costs are those of align_sequences() in pairwise_prescan2.c, but only 
+   the band is computed, a row of scores at a time, keeping the traceback
+   directions of the band. */
+
+static void align_hit(scan_state_t *st, uchar *q, int q_length, uchar *s, 
+		      int s_length, int min_di, int max_di, 
+		      hit_alignment_t *a) {
+  int *prev, *cur, *tmp;
+  uchar *bt, dir;
+  int w, i, j, k, h, score, best, best_i, best_k;
+
+  memset(a, 0, sizeof(hit_alignment_t));
+  if (min_di < 1 - q_length) min_di = 1 - q_length;
+  if (max_di > s_length - 1) max_di = s_length - 1;
+  if (min_di > max_di) return;
+  w = max_di - min_di + 1;
+
+  if (st->align_rows_allocsize < 2*(w + 2)) {
+    st->align_rows_allocsize = 2*(w + 2);
+    RA(st->align_rows, st->align_rows_allocsize, sizeof(int));
+  }
+  if (st->align_bt_allocsize < (size_t) q_length*w) {
+    st->align_bt_allocsize = (size_t) q_length*w;
+    RA(st->align_bt, st->align_bt_allocsize, sizeof(uchar));
+  }
+  /* Cell k of a row is diagonal min_di + k - 1; cells 0 and w + 1, off the
+     band, stay 0 */
+  prev = st->align_rows;
+  cur = prev + w + 2;
+  for(k=0;k<w+2;k++) prev[k] = cur[k] = 0;
+
+  best = best_i = best_k = 0;
+  for(i=1;i<=q_length;i++) {
+    bt = st->align_bt + (size_t) (i - 1)*w - 1;
+    for(k=1;k<=w;k++) {
+      j = i + min_di + k - 1;
+      h = 0;
+      dir = 0;
+      if (j >= 1 && j <= s_length) {
+	score = prev[k] + (q[i-1] == s[j-1] ? ALIGN_MATCH : ALIGN_MISMATCH);
+	if (score > h) {
+	  h = score;
+	  dir = 1;
+	}
+	score = prev[k+1] + ALIGN_GAP;
+	if (score > h) {
+	  h = score;
+	  dir = 2;
+	}
+	score = cur[k-1] + ALIGN_GAP;
+	if (score > h) {
+	  h = score;
+	  dir = 3;
+	}
+      }
+      cur[k] = h;
+      bt[k] = dir;
+      if (h > best) {
+	best = h;
+	best_i = i;
+	best_k = k;
+      }
+    }
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+  if (best == 0) return;
+
+  i = best_i;
+  k = best_k;
+  a->q_end = i - 1;
+  a->s_end = i + min_di + k - 2;
+  while(i > 0 && (dir = st->align_bt[(size_t) (i - 1)*w + k - 1]) != 0) {
+    j = i + min_di + k - 1;
+    switch(dir) {
+    case 1:
+      if (q[i-1] == s[j-1]) a->matches++;
+      i--;
+      break;
+    case 2:
+      i--;
+      k++;
+      break;
+    case 3:
+      k--;
+      break;
+    }
+    a->length++;
+  }
+  a->q_start = i;
+  a->s_start = i + min_di + k - 1;
+}
+
+/* Aligns the <n_hits> hits in st->report_hits of query <seq>, on the strand
+   being reported, and keeps those reaching min_identity. Returns the number
+   of hits kept. */
+static int verify_hits(scan_state_t *st, uchar *seq, int length, 
+		       int n_hits) {
+  hit_report_t *h;
+  hit_alignment_t *a;
+  int j, k, s_length;
+
+  for(j=k=0;j<n_hits;j++) {
+    h = st->report_hits + j;
+    s_length = seqmeta[h->db_seq].seq_length;
+    if (s_length > st->target_size) {
+      st->target_size = s_length;
+      RA(st->target, st->target_size, sizeof(uchar));
+    }
+    read_sequence(&target_db, h->db_seq, st->target, NULL);
+    a = &h->alignment;
+    align_hit(st, seq, length, st->target, s_length, h->min_di, h->max_di,
+	      a);
+    if (a->length == 0 || 100.0*a->matches < min_identity*a->length) 
+      continue;
+    st->report_hits[k++] = *h;
+  }
+  return k;
+}
+
+/* Scans both strands of a query, printing the hits of the forward strand
+   and then those of the reverse complement */
+static void fasta_scan(scan_state_t *st, uchar *seq, uchar *qual, 
+		       uint seq_id, int length) {
+  wordhit_t *hits[2];
+  int n_hits[2], s, n;
+
+  stage_start(st);
+  arena_reset(&st->arena);
+  query_wordmatches(st, seq, qual, seq_id, length, hits, n_hits);
+  stage_done(st, batch ? STAGE_FILTER : STAGE_COMPILE);
+  for(s=0;s<2;s++) {
+    if (hits[s] == NULL) continue;
+    if (diagonal_runs && !fine_words) {
+      st->stats.runs += n_hits[s];
+      n = chain_hit_runs(st, hits[s], n_hits[s], length, st->report_hits);
+      stage_done(st, STAGE_CHAIN);
+    } else {
+      n = chain_wordhits(st, hits[s], n_hits[s], length, st->report_hits);
+    }
+    if (verify) {
+      if (s == 1) reverse_complement(st->rc_seq, seq, length);
+      n = verify_hits(st, s ? st->rc_seq : seq, length, n);
+      stage_done(st, STAGE_VERIFY);
+    }
+    print_hits(st, seq_id, length, n, s);
+    st->stats.pairs += n;
+    stage_done(st, STAGE_OUTPUT);
+  }
+  st->stats.queries++;
+}
+
+/* Partial results (--partial) of scanning a word-range table. For every
+   query and strand, in order, a record header is written:
+
+     uint query, uint strand, uint n_targets, uint n_hits
+
+   followed by n_targets pairs (uint target, uint count) in order of target,
+   and then the n_hits (int di, int pos) word hits, grouped by target in the
+   same order. Targets are all those with at least one word hit in the 
+   table's slice of the word space. */
+typedef struct {
+  uint query;
+  uint strand;
+  uint n_targets;
+  uint n_hits;
+} partial_record_t;
+
+typedef struct {
+  uint target;
+  uint count;
+} partial_target_t;
+
+static void write_partial_header(FILE *f) {
+  uint x;
+
+  x = PARTIAL_MAGIC;
+  fwrite(&x, sizeof(uint), 1, f);
+  fwrite(&ltable_header.wordsize, sizeof(uint), 1, f);
+  fwrite(&ltable_header.seq_start, sizeof(uint), 1, f);
+  fwrite(&ltable_header.seq_end, sizeof(uint), 1, f);
+  fwrite(&ltable_header.word_start, sizeof(uint), 1, f);
+  fwrite(&ltable_header.word_end, sizeof(uint), 1, f);
+  fwrite(&query_db->n_seq, sizeof(uint), 1, f);
+}
+
+static void write_partial(scan_state_t *st, uchar *seq, uchar *qual, 
+			  uint seq_id, int length) {
+  wordhit_t *hits[2], *h;
+  int n_hits[2], i, j, s;
+  partial_record_t r;
+  partial_target_t t;
+  int x[2];
+
+  stage_start(st);
+  arena_reset(&st->arena);
+  query_wordmatches(st, seq, qual, seq_id, length, hits, n_hits);
+  stage_done(st, batch ? STAGE_FILTER : STAGE_COMPILE);
+  for(s=0;s<2;s++) {
+    h = hits[s];
+    if (h) sort_wordhits(st, h, n_hits[s]);
+    stage_done(st, STAGE_SORT);
+
+    r.query = seq_id;
+    r.strand = s;
+    r.n_hits = n_hits[s];
+    r.n_targets = 0;
+    for(i=0;i<n_hits[s];i++) {
+      if (i == 0 || h[i].db_seq != h[i-1].db_seq) r.n_targets++;
+    }
+    out_write(st, &r, sizeof(partial_record_t));
+
+    i = j = 0;
+    while(i < n_hits[s]) {
+      while(j < n_hits[s] && h[j].db_seq == h[i].db_seq) j++;
+      t.target = h[i].db_seq;
+      t.count = j - i;
+      out_write(st, &t, sizeof(partial_target_t));
+      i = j;
+    }
+    for(i=0;i<n_hits[s];i++) {
+      x[0] = h[i].di;
+      x[1] = h[i].pos;
+      out_write(st, x, sizeof(int)*2);
+    }
+    stage_done(st, STAGE_OUTPUT);
+  }
+  st->stats.queries++;
+}
+
+/* --stats: the counters of the blocks finished so far, summed over the 
+   threads and the rounds of tables, and the count of queries at which 
+   the next line is due with --stats-every */
+static scan_stats_t total_stats;
+static double next_stats;
+static long long stats_started;
+
+/* Adds the counters of <from> to <to> and clears them */
+static void add_stats(scan_stats_t *to, scan_stats_t *from) {
+  int k;
+
+  to->queries += from->queries;
+  to->words += from->words;
+  to->distinct += from->distinct;
+  to->postings += from->postings;
+  to->walked += from->walked;
+  to->targets += from->targets;
+  to->hits += from->hits;
+  to->runs += from->runs;
+  to->chain_nodes += from->chain_nodes;
+  to->pairs += from->pairs;
+  for(k=0;k<N_STAGES;k++) to->ns[k] += from->ns[k];
+  memset(from, 0, sizeof(scan_stats_t));
+}
+
+/* Writes total_stats to the --stats file as a line of JSON. Stage times
+   are in nanoseconds summed over the threads, so that with several 
+   threads they add up to more than the elapsed seconds. */
+static void write_stats(int final) {
+  int k;
+
+  fprintf(stats_file, "{\"final\": %s, \"seconds\": %.3f, \"threads\": %d, "
+	  "\"queries\": %.0f, \"words\": %.0f, \"distinct\": %.0f, "
+	  "\"postings\": %.0f, \"walked\": %.0f, "
+	  "\"targets\": %.0f, \"hits\": %.0f, \"runs\": %.0f, "
+	  "\"chain_nodes\": %.0f, \"pairs\": %.0f, \"ns\": {", 
+	  final ? "true" : "false", 1e-9*(stage_clock() - stats_started),
+	  n_threads, total_stats.queries, total_stats.words, 
+	  total_stats.distinct, total_stats.postings, total_stats.walked,
+	  total_stats.targets, total_stats.hits, 
+	  total_stats.runs, total_stats.chain_nodes, total_stats.pairs);
+  for(k=0;k<N_STAGES;k++) {
+    fprintf(stats_file, "%s\"%s\": %lld", k ? ", " : "", stage_names[k],
+	    total_stats.ns[k]);
+  }
+  fprintf(stats_file, "}}\n");
+  if (fflush(stats_file)) {
+    logmsg(MSG_FATAL,"! Failed writing stats to %s (%s)\n", stats_filename,
+	   strerror(errno));
+  }
+}
+
+/* --merge: combines the partial results of scanning every word-range table
+   of a database, summing the word hit counts of each target over all the 
+   tables before applying the threshold, then chaining and reporting hits
+   exactly as a scan against a single table would. */
+static void merge_partial_scans(int n_files, char **filenames) {
+  FILE **pf;
+  uint x, i, q, strand, hdr[6];
+  int k, n_hits;
+  uint seq_start, seq_end, n_query;
+  double words_covered;
+  partial_record_t *r;
+  partial_target_t **targets;
+  int *tsize;
+  wordhit_t *hits;
+  int *hits_byseq;
+  scan_state_t st;
+  int d[2];
+
+  MA(pf, sizeof(FILE *)*n_files);
+  MA(r, sizeof(partial_record_t)*n_files);
+  CA(targets, n_files, sizeof(partial_target_t *));
+  CA(tsize, n_files, sizeof(int));
+  seq_start = seq_end = n_query = 0;
+  words_covered = 0.0;
+  for(k=0;k<n_files;k++) {
+    pf[k] = fopen(filenames[k], "r");
+    if (pf[k] == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening partial scan file %s (%s)\n",
+	     filenames[k], strerror(errno));
+    }
+    fread(&x, sizeof(uint), 1, pf[k]);
+    if (x != PARTIAL_MAGIC || fread(hdr, sizeof(uint), 6, pf[k]) != 6) {
+      logmsg(MSG_FATAL,"! %s does not appear to be a partial scan file\n",
+	     filenames[k]);
+    }
+    if (k == 0) {
+      wordsize = hit_wordsize = hdr[0];
+      seq_start = hdr[1];
+      seq_end = hdr[2];
+      n_query = hdr[5];
+    } else if (hdr[0] != wordsize || hdr[1] != seq_start || 
+	       hdr[2] != seq_end || hdr[5] != n_query) {
+      logmsg(MSG_FATAL,"! Partial scan file %s does not match %s\n",
+	     filenames[k], filenames[0]);
+    }
+    words_covered += hdr[4] - hdr[3];
+  }
+  if (words_covered != (double) (0x1 << (wordsize*2))) {
+    logmsg(MSG_WARNING,"Partial scan files cover %.0f of %u words\n",
+	   words_covered, 0x1 << (wordsize*2));
+  }
+  if (n_query != query_db->n_seq) {
+    logmsg(MSG_FATAL,"! Partial scans are of %u queries, database has %u\n",
+	   n_query, query_db->n_seq);
+  }
+  ltable_start = seq_start;
+  ltable_end = seq_end + 1;
+  if (binary_output) write_hitfile_header(stdout, n_seq, wordsize, verify);
+
+  CA(hits_byseq, ltable_end - ltable_start, sizeof(int));
+  init_scan_state(&st);
+  for(q=0;q<n_query;q++) {
+    if (verify) {
+      read_query(&st, q);
+      reverse_complement(st.rc_seq, st.seq, query_db->meta[q].seq_length);
+    }
+    for(strand=0;strand<2;strand++) {
+      stage_start(&st);
+      /* Sum the word hit counts over all tables */
+      for(k=0;k<n_files;k++) {
+	if (fread(r + k, sizeof(partial_record_t), 1, pf[k]) != 1 ||
+	    r[k].query != q || r[k].strand != strand) {
+	  logmsg(MSG_FATAL,"! Partial scan file %s is truncated or out of "
+		 "order at query %u\n", filenames[k], q);
+	}
+	if (r[k].n_targets > tsize[k]) {
+	  tsize[k] = r[k].n_targets;
+	  RA(targets[k], tsize[k], sizeof(partial_target_t));
+	}
+	if (fread(targets[k], sizeof(partial_target_t), r[k].n_targets, 
+		  pf[k]) != r[k].n_targets) {
+	  logmsg(MSG_FATAL,"! Partial scan file %s is truncated or out of "
+		 "order at query %u\n", filenames[k], q);
+	}
+	for(i=0;i<r[k].n_targets;i++) {
+	  if (targets[k][i].target < ltable_start || 
+	      targets[k][i].target >= ltable_end) {
+	    logmsg(MSG_FATAL,"! Partial scan file %s is truncated or out of "
+		   "order at query %u\n", filenames[k], q);
+	  }
+	  hits_byseq[targets[k][i].target - ltable_start] += 
+	    targets[k][i].count;
+	}
+      }
+
+      /* Gather the word hits of targets reaching the threshold */
+      n_hits = 0;
+      for(k=0;k<n_files;k++) {
+	for(i=0;i<r[k].n_targets;i++) {
+	  if (hits_byseq[targets[k][i].target - ltable_start]*2 >= 
+	      SCORE_THRESHOLD) {
+	    n_hits += targets[k][i].count;
+	  }
+	}
+      }
+      st.stats.hits += n_hits;
+      arena_reset(&st.arena);
+      hits = NULL;
+      if (n_hits > 0) {
+	hits = arena_alloc(&st.arena, sizeof(wordhit_t)*n_hits);
+      }
+      n_hits = 0;
+      for(k=0;k<n_files;k++) {
+	for(i=0;i<r[k].n_targets;i++) {
+	  int pass, c;
+
+	  pass = hits_byseq[targets[k][i].target - ltable_start]*2 >= 
+	    SCORE_THRESHOLD;
+	  for(c=0;c<targets[k][i].count;c++) {
+	    if (fread(d, sizeof(int), 2, pf[k]) != 2) {
+	      logmsg(MSG_FATAL,"! Partial scan file %s is truncated or out of "
+		     "order at query %u\n", filenames[k], q);
+	    }
+	    if (!pass) continue;
+	    hits[n_hits].db_seq = targets[k][i].target;
+	    hits[n_hits].di = d[0];
+	    hits[n_hits].pos = d[1];
+	    n_hits++;
+	  }
+	}
+      }
+      for(k=0;k<n_files;k++) {
+	for(i=0;i<r[k].n_targets;i++) {
+	  if (hits_byseq[targets[k][i].target - ltable_start]) {
+	    if (hits_byseq[targets[k][i].target - ltable_start]*2 >= 
+		SCORE_THRESHOLD) st.stats.targets++;
+	    hits_byseq[targets[k][i].target - ltable_start] = 0;
+	  }
+	}
+      }
+      /* Reading the partial scans stands for the lookups */
+      stage_done(&st, STAGE_LOOKUP);
+
+      if (hits) {
+	n_hits = chain_wordhits(&st, hits, n_hits, 
+				query_db->meta[q].seq_length, st.report_hits);
+	if (verify) {
+	  n_hits = verify_hits(&st, strand ? st.rc_seq : st.seq, 
+			       query_db->meta[q].seq_length, n_hits);
+	  stage_done(&st, STAGE_VERIFY);
+	}
+	print_hits(&st, q, query_db->meta[q].seq_length, n_hits, strand);
+	if (st.out_length > 0) {
+	  fwrite(st.out, sizeof(char), st.out_length, stdout);
+	  st.out_length = 0;
+	}
+	st.stats.pairs += n_hits;
+	stage_done(&st, STAGE_OUTPUT);
+      }
+    }
+    st.stats.queries++;
+  }
+  if (stats_filename) {
+    add_stats(&total_stats, &st.stats);
+    write_stats(1);
+  }
+
+  for(k=0;k<n_files;k++) {
+    fclose(pf[k]);
+    free(targets[k]);
+  }
+  free(targets);
+  free(tsize);
+  free(r);
+  free(pf);
+  free(hits_byseq);
+  free_scan_state(&st);
+}
+
+static void usage(char *program_name) {
+
+  fprintf(stderr,"\n\n%s:\n\n"
+"Quick program to scan formatted sequence file against a pre-formatted \n"
+"database of words (sub-sequence), to approximate alignment by linking \n"
+"together consecutive sequences of matching words.\n"
+"\n"
+"Options:\n"
+"--seqfile=<basename> (-s) (required)\n"
+"    Basename of preformatted sequence 'database'\n"
+"--queries=<basename> (-S)\n"
+"    Scan the sequences of this formatted database (format_seqdata), such as\n"
+"    a new batch of reads, against the lookup tables of --seqfile instead of\n"
+"    those of --seqfile itself. Every target is reported, rather than only\n"
+"    those from the query's number on. Query numbers in the output are\n"
+"    those of this database and target numbers those of --seqfile; with\n"
+"    --min-quality, the quality file of this database is read. Not used\n"
+"    with --binary, whose hit files number queries and targets alike.\n"
+"--lookupfile=<lookup file> (-l) (required)\n"
+"    Preformatted lookup table. May be given several times, and more lookup\n"
+"    files may be named after the options: the queries are then read once\n"
+"    and scanned against all the tables in the same run.\n"
+"--manifest=<file> (-m)\n"
+"    Instead of --lookupfile, scan against all the tables listed in a\n"
+"    manifest written by format_lookup, base and delta tables alike.\n"
+"--memsize=<integer> (-x)\n"
+"    Memory, in MB, for the lookup tables of a scan against several tables.\n"
+"    Dense tables that fit together are loaded as one and every query probes\n"
+"    them all at once; otherwise the tables are loaded in rounds, and the\n"
+"    queries, read once, are scanned again in each round. Sparse tables are\n"
+"    always scanned in a round of their own. 0 (no limit) by default.\n"
+"--min-quality=<integer> (-q)\n"
+"    Skip query words containing a base with phred quality below this value.\n"
+"    Requires <basename>.qbin, written by format_seqdata --qualfile. Should\n"
+"    normally match the value given to format_lookup. 0 (off) by default.\n"
+"--partial (-p)\n"
+"    Write partial results in binary to standard output instead of hits: the\n"
+"    word hits of every target, before the word count threshold is applied.\n"
+"    Used to scan the tables of format_lookup --partition=words.\n"
+"--merge (-M)\n"
+"    Read the --partial outputs named on the command line, one for each\n"
+"    word-range table of the database, and report the combined hits. No\n"
+"    lookup file is needed.\n"
+"--no-bloom (-B)\n"
+"    Ignore the Bloom filter of a sparse lookup table (format_lookup --bloom)\n"
+"    and look every query word up in the table itself.\n"
+"--refine (-r)\n"
+"    Coarse-to-fine search with a layered index (format_lookup\n"
+"    --fine-wordsize): targets with at least --coarse-hits hits of the\n"
+"    table's words are candidates, and the hits reported for them are\n"
+"    those of the short words in <lookup file>.fine.\n"
+"--coarse-hits=<integer> (-c)\n"
+"    Long word hits a target needs to be refined. 1 by default.\n"
+"--binary (-b)\n"
+"    Write hits as fixed size binary records (see hit_file.h) instead of\n"
+"    text, for dfs_cluster --hits and other readers of hit_file.c.\n"
+"--verify (-V)\n"
+"    Check every hit with a banded alignment, within the diagonals of its\n"
+"    chain of word hits, and add to each line the percent identity, length\n"
+"    and start and end on query and target of the alignment (or to each\n"
+"    record with --binary). Hits without an alignment are dropped.\n"
+"--min-identity=<percent> (-I)\n"
+"    With --verify (implied), drop hits whose alignment has a lower percent\n"
+"    identity. 0 by default.\n"
+"--batch=<integer> (-Q)\n"
+"    Scan the queries in blocks of this many together: the words of a block\n"
+"    are sorted and the postings of each word read once for all its queries,\n"
+"    sweeping the lookup table in order rather than probing it at random.\n"
+"    Same results; memory grows with the word hits of a block. Not used\n"
+"    with --refine, --diagonal-runs or --two-hit.\n"
+"--prefetch=<integer> (-P)\n"
+"    Prefetch the lookup table entries of the query word this many words\n"
+"    ahead of the one looked up, and the first postings of the word half as\n"
+"    far ahead. 0 turns prefetching off. %d by default: time a distance\n"
+"    with --probe-benchmark on the host before turning it on.\n"
+"--probe-benchmark (-e)\n"
+"    Instead of scanning, time the lookups of the query words in the tables\n"
+"    at prefetch distances from 0 to 64 and report the time per lookup.\n"
+"--max-targets=<integer> (-N)\n"
+"    Report at most this many targets per query and strand, those of the\n"
+"    best chain scores (ties to the lowest target number), still in order\n"
+"    of target. Targets that can not make the cut are not chained. With\n"
+"    --verify the best chains are aligned, and may then be dropped. 0 (all)\n"
+"    by default.\n"
+"--two-hit=<score> (-T)\n"
+"    Only chain targets passing the word count threshold that also have two\n"
+"    nearby non-overlapping word hits on close diagonals, whose ungapped\n"
+"    X-drop extension (match 2, mismatch -5) scores at least this. 0 (off)\n"
+"    by default.\n"
+"--diagonal-runs (-D)\n"
+"    Merge word hits into runs along each diagonal as they are found, instead\n"
+"    of collecting and sorting every hit. Same results, with memory in\n"
+"    proportion to the number of runs. Not used with --refine.\n"
+"--query-start=<integer> (-a)\n"
+"--query-end=<integer> (-z)\n"
+"    Scan only the queries numbered from --query-start up to, but not\n"
+"    including, --query-end; by default all of them. Several processes or\n"
+"    hosts can share the scan of a table this way, and the outputs of\n"
+"    consecutive ranges put one after the other are those of a single run\n"
+"    (with --binary, each starts with its own header). Not used with\n"
+"    --partial or --merge.\n"
+"--output=<file> (-o)\n"
+"    Write the hits to this file instead of the standard output.\n"
+"--checkpoint=<file> (-k)\n"
+"    Record the progress of the scan in this file, with --output. Started\n"
+"    again with the same options after being interrupted, the scan cuts\n"
+"    the output back to the last checkpoint and goes on from there, giving\n"
+"    the same output as an uninterrupted run. The file is left at the end\n"
+"    of the run, and a run with a finished checkpoint does nothing; remove\n"
+"    it to start over.\n"
+"--checkpoint-interval=<seconds> (-K)\n"
+"    Least time between checkpoints. %d by default.\n"
+"--stats=<file> (-j)\n"
+"    Count the query words and distinct words looked up, their postings,\n"
+"    per word and as read, targets passing the word count threshold, word\n"
+"    hits, runs and chain nodes chained and hits reported, time each stage\n"
+"    of the scan of a query (lookup, filter, compile, sort, combine, chain,\n"
+"    verify, output) and write the totals to this file at the end, as a\n"
+"    line of JSON. Times are in nanoseconds, summed over the threads.\n"
+"--stats-every=<integer> (-J)\n"
+"    With --stats, also write the totals so far every this many queries.\n"
+"--threads=<integer> (-t)\n"
+"    Number of scanning threads. Queries are shared out in small blocks,\n"
+"    idle threads steal blocks from busy ones, and the output is written in\n"
+"    query order, identical to that of a single thread. 1 by default.\n"
+"--verbose=<integer> (-v)\n"
+"    Verbosity level. 0 (normal) by default. Negative enables debugging messages\n"
+"    Positive makes program quieter.\n"
+"--help (-h)\n"
+"    Prints this message.\n"
+,program_name, PREFETCH_DISTANCE, CHECKPOINT_INTERVAL);
+
+}
+
+
+static void parse_arguments(int argc, char *argv[]) {
+  int option_index, commandline_error, rval;
+  struct option longopts[] = {
+    { "seqfile", 1, NULL, 's'},
+    { "lookupfile", 1, NULL, 'l'},
+    { "min-quality", 1, NULL, 'q'},
+    { "partial", 0, NULL, 'p'},
+    { "merge", 0, NULL, 'M'},
+    { "no-bloom", 0, NULL, 'B'},
+    { "refine", 0, NULL, 'r'},
+    { "manifest", 1, NULL, 'm'},
+    { "threads", 1, NULL, 't'},
+    { "memsize", 1, NULL, 'x'},
+    { "diagonal-runs", 0, NULL, 'D'},
+    { "binary", 0, NULL, 'b'},
+    { "verify", 0, NULL, 'V'},
+    { "min-identity", 1, NULL, 'I'},
+    { "two-hit", 1, NULL, 'T'},
+    { "batch", 1, NULL, 'Q'},
+    { "prefetch", 1, NULL, 'P'},
+    { "probe-benchmark", 0, NULL, 'e'},
+    { "max-targets", 1, NULL, 'N'},
+    { "queries", 1, NULL, 'S'},
+    { "query-start", 1, NULL, 'a'},
+    { "query-end", 1, NULL, 'z'},
+    { "output", 1, NULL, 'o'},
+    { "checkpoint", 1, NULL, 'k'},
+    { "checkpoint-interval", 1, NULL, 'K'},
+    { "stats", 1, NULL, 'j'},
+    { "stats-every", 1, NULL, 'J'},
+    { "coarse-hits", 1, NULL, 'c'},
+    { "verbose", 1, NULL, 'v'},
+    { "help", 1, NULL, 'h'},
+    { NULL, 0, NULL, 0}
+  };
+  char *optstring = "s:l:m:q:v:c:t:x:I:T:Q:P:N:S:a:z:o:k:K:j:J:hpMBrDbVe";
+
+  commandline_error = 0;
+  while((rval = getopt_long(argc, argv, optstring, longopts, &option_index))
+	!= -1) {
+    switch(rval) {
+    case ':':
+      logmsg(MSG_ERROR,"\n! Option \"%s\" requires an argument.\n",
+	     longopts[option_index].name);
+      commandline_error = 1;
+      break;
+    case 'l':
+      PUSH(lookup_filenames, n_lookupfiles, sizeof(uchar *));
+      lookup_filenames[n_lookupfiles++] = strdup(optarg);
+      break;
+    case 'q':
+      min_quality = atoi(optarg);
+      break;
+    case 'p':
+      partial_output = 1;
+      break;
+    case 'M':
+      merge_partials = 1;
+      break;
+    case 'B':
+      use_bloom = 0;
+      break;
+    case 'r':
+      refine = 1;
+      break;
+    case 'm':
+      manifest_filename = strdup(optarg);
+      break;
+    case 't':
+      n_threads = atoi(optarg);
+      break;
+    case 'x':
+      memsize = atoi(optarg);
+      break;
+    case 'D':
+      diagonal_runs = 1;
+      break;
+    case 'b':
+      binary_output = 1;
+      break;
+    case 'V':
+      verify = 1;
+      break;
+    case 'I':
+      min_identity = atof(optarg);
+      verify = 1;
+      break;
+    case 'T':
+      two_hit_score = atoi(optarg);
+      break;
+    case 'Q':
+      query_block = atoi(optarg);
+      batch = 1;
+      break;
+    case 'P':
+      prefetch_distance = atoi(optarg);
+      break;
+    case 'e':
+      probe_benchmark = 1;
+      break;
+    case 'N':
+      max_targets = atoi(optarg);
+      break;
+    case 'c':
+      coarse_hits = atoi(optarg);
+      break;
+    case 'v':
+      verbosity_level = atoi(optarg);
+      break;
+    case 's':
+      seq_filename = strdup(optarg);
+      break;
+    case 'S':
+      query_filename = strdup(optarg);
+      break;
+    case 'a':
+      query_start = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      query_end = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      output_filename = strdup(optarg);
+      break;
+    case 'k':
+      checkpoint_filename = strdup(optarg);
+      break;
+    case 'K':
+      checkpoint_interval = atoi(optarg);
+      break;
+    case 'j':
+      stats_filename = strdup(optarg);
+      break;
+    case 'J':
+      stats_every = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+      break;
+    case '?':
+    default:
+      logmsg(MSG_ERROR,"\n! Option \"%c\" unknown.\n",optopt);
+      commandline_error = 1;
+      break;
+    }
+  }
+
+  /* Lookup files may also follow the options, except with --merge */
+  while(!merge_partials && optind < argc) {
+    PUSH(lookup_filenames, n_lookupfiles, sizeof(uchar *));
+    lookup_filenames[n_lookupfiles++] = strdup(argv[optind++]);
+  }
+
+  if (manifest_filename && (n_lookupfiles > 0 || refine)) {
+    logmsg(MSG_ERROR,"! --manifest replaces --lookupfile, and can not be used "
+	   "with --refine\n");
+    commandline_error = 1;
+  }
+
+  if (n_lookupfiles == 0 && manifest_filename == NULL && 
+      !merge_partials) {
+    logmsg(MSG_ERROR,"! Formatted lookup file must be "
+	   "specified with -l <lookup file> or --seqfile=<lookup file> "
+	   "option\n");
+    commandline_error = 1;
+  }
+
+  if (refine && n_lookupfiles > 1) {
+    logmsg(MSG_ERROR,"! --refine scans a single lookup file\n");
+    commandline_error = 1;
+  }
+
+  if (memsize < 0) {
+    logmsg(MSG_ERROR,"! --memsize can not be negative\n");
+    commandline_error = 1;
+  }
+
+  if (seq_filename == NULL) {
+    logmsg(MSG_ERROR,"! Formatted sequence database basename must be "
+	   "specified with -s <basename> or --seqfile=<basename> "
+	   "option\n");
+    commandline_error = 1;
+  }
+
+  if (min_quality < 0 || min_quality > 255) {
+    logmsg(MSG_ERROR,"! Minimum base quality must be between 0 and 255\n");
+    commandline_error = 1;
+  }
+
+  if (merge_partials && optind >= argc) {
+    logmsg(MSG_ERROR,"! --merge requires the partial scan files to be "
+	   "named on the command line\n");
+    commandline_error = 1;
+  }
+
+  if (refine && (merge_partials || partial_output)) {
+    logmsg(MSG_ERROR,"! --refine can not be used with --partial or "
+	   "--merge\n");
+    commandline_error = 1;
+  }
+
+  if (diagonal_runs && (partial_output || merge_partials)) {
+    logmsg(MSG_ERROR,"! --diagonal-runs can not be used with --partial or "
+	   "--merge\n");
+    commandline_error = 1;
+  }
+
+  if (n_threads < 1) {
+    logmsg(MSG_ERROR,"! --threads must be at least 1\n");
+    commandline_error = 1;
+  }
+
+  if (coarse_hits < 1 || coarse_hits > COUNT_MAX) {
+    logmsg(MSG_ERROR,"! --coarse-hits must be from 1 to %d\n", COUNT_MAX);
+    commandline_error = 1;
+  }
+
+  if (binary_output && partial_output) {
+    logmsg(MSG_ERROR,"! --binary and --partial are mutually exclusive\n");
+    commandline_error = 1;
+  }
+
+  if (verify && partial_output) {
+    logmsg(MSG_ERROR,"! --verify and --partial are mutually exclusive\n");
+    commandline_error = 1;
+  }
+
+  if (two_hit_score < 0) {
+    logmsg(MSG_ERROR,"! --two-hit can not be negative\n");
+    commandline_error = 1;
+  }
+
+  if (two_hit_score && (refine || partial_output || merge_partials)) {
+    logmsg(MSG_ERROR,"! --two-hit can not be used with --refine, --partial "
+	   "or --merge\n");
+    commandline_error = 1;
+  }
+
+  if (batch && query_block < 1) {
+    logmsg(MSG_ERROR,"! --batch must be at least 1\n");
+    commandline_error = 1;
+  }
+
+  if (batch && (refine || diagonal_runs || two_hit_score)) {
+    logmsg(MSG_ERROR,"! --batch can not be used with --refine, "
+	   "--diagonal-runs or --two-hit\n");
+    commandline_error = 1;
+  }
+
+  if ((query_start > 0 || query_end != UINT_MAX) && 
+      (partial_output || merge_partials)) {
+    logmsg(MSG_ERROR,"! --query-start and --query-end can not be used with "
+	   "--partial or --merge, which cover every query\n");
+    commandline_error = 1;
+  }
+
+  if (checkpoint_filename && (output_filename == NULL || merge_partials ||
+			      probe_benchmark)) {
+    logmsg(MSG_ERROR,"! --checkpoint needs --output, and can not be used "
+	   "with --merge or --probe-benchmark\n");
+    commandline_error = 1;
+  }
+
+  if (checkpoint_interval < 0) {
+    logmsg(MSG_ERROR,"! --checkpoint-interval can not be negative\n");
+    commandline_error = 1;
+  }
 
-    i = j;
+  if (stats_every < 0 || (stats_every && stats_filename == NULL)) {
+    logmsg(MSG_ERROR,"! --stats-every needs --stats, and can not be "
+	   "negative\n");
+    commandline_error = 1;
   }
-  free(adjmatrix);
-  free(pred);
-  free(score);
-  free(hits);
-  return n_hits;
-}
 
-static void usage(char *program_name) {
+  if (stats_filename && probe_benchmark) {
+    logmsg(MSG_ERROR,"! --stats can not be used with --probe-benchmark\n");
+    commandline_error = 1;
+  }
 
-  fprintf(stderr,"\n\n%s:\n\n"
-"Quick program to scan formatted sequence file against a pre-formatted \n"
-"database of words (sub-sequence), to approximate alignment by linking \n"
-"together consecutive sequences of matching words.\n"
-"\n"
-"Options:\n"
-"--seqfile=<basename> (-s) (required)\n"
-"    Basename of preformatted sequence 'database'\n"
-"--lookupfile=<lookup file> (-l) (required)\n"
-"    Preformatted lookup table\n"
-"--verbose=<integer> (-v)\n"
-"    Verbosity level. 0 (normal) by default. Negative enables debugging messages\n"
-"    Positive makes program quieter.\n"
-"--help (-h)\n"
-"    Prints this message.\n"
-,program_name);
+  if (max_targets < 0) {
+    logmsg(MSG_ERROR,"! --max-targets can not be negative\n");
+    commandline_error = 1;
+  }
 
-}
+  if (max_targets && partial_output) {
+    logmsg(MSG_ERROR,"! --max-targets applies to --merge, not --partial\n");
+    commandline_error = 1;
+  }
 
+  if (prefetch_distance < 0) {
+    logmsg(MSG_ERROR,"! --prefetch can not be negative\n");
+    commandline_error = 1;
+  }
 
-static void parse_arguments(int argc, char *argv[]) {
-  int option_index, commandline_error, rval;
-  struct option longopts[] = {
-    { "seqfile", 1, NULL, 's'},
-    { "lookupfile", 1, NULL, 'l'},
-    { "verbose", 1, NULL, 'v'},
-    { "help", 1, NULL, 'h'},
-    { NULL, 0, NULL, 0}
-  };
-  char *optstring = "s:l:v:h";
+  if (probe_benchmark && (partial_output || merge_partials || binary_output)) {
+    logmsg(MSG_ERROR,"! --probe-benchmark can not be used with --partial, "
+	   "--merge or --binary\n");
+    commandline_error = 1;
+  }
 
-  commandline_error = 0;
-  while((rval = getopt_long(argc, argv, optstring, longopts, &option_index))
-	!= -1) {
-    switch(rval) {
-    case ':':
-      logmsg(MSG_ERROR,"\n! Option \"%s\" requires an argument.\n",
-	     longopts[option_index].name);
-      commandline_error = 1;
-      break;
-    case 'l':
-      lookup_filename = strdup(optarg);
-      break;
-    case 'v':
-      verbosity_level = atoi(optarg);
-      break;
-    case 's':
-      seq_filename = strdup(optarg);
-      break;
-    case 'h':
-      usage(argv[0]);
-      exit(0);
-      break;
-    case '?':
-    default:
-      logmsg(MSG_ERROR,"\n! Option \"%c\" unknown.\n",optopt);
-      commandline_error = 1;
-      break;
-    }
+  if (min_identity < 0.0 || min_identity > 100.0) {
+    logmsg(MSG_ERROR,"! --min-identity must be a percentage\n");
+    commandline_error = 1;
   }
 
-  if (lookup_filename == NULL) {
-    logmsg(MSG_ERROR,"! Formatted lookup file must be "
-	   "specified with -l <lookup file> or --seqfile=<lookup file> "
-	   "option\n");
+  if (merge_partials && partial_output) {
+    logmsg(MSG_ERROR,"! --merge and --partial are mutually exclusive\n");
     commandline_error = 1;
   }
 
-  if (seq_filename == NULL) {
-    logmsg(MSG_ERROR,"! Formatted sequence database basename must be "
-	   "specified with -s <basename> or --seqfile=<basename> "
-	   "option\n");
+  /* Hit files hold the ids of a single database (see hit_file.h) */
+  if (query_filename && binary_output) {
+    logmsg(MSG_ERROR,"! --queries and --binary are mutually exclusive\n");
     commandline_error = 1;
   }
   
@@ -533,15 +3134,18 @@ static void parse_arguments(int argc, char *argv[]) {
 
 }
 
-static void open_databasefiles(FILE **indfile, FILE **binfile) {
+/* Opens the database <basename> into <sdb>, with its quality file if
+   <quality> */
+static void open_databasefiles(uchar *basename, seqdb_t *sdb, int quality) {
   int l;
   uchar *temp;
   uint x;
   FILE *f;
 
-  l = strlen(seq_filename) + 6;
+  sdb->basename = basename;
+  l = strlen(basename) + 6;
   MA(temp, l);
-  strcpy(temp, seq_filename);
+  strcpy(temp, basename);
   strcat(temp, ".ind");
   f = fopen(temp, "r");
   if (f == NULL) {
@@ -552,12 +3156,12 @@ static void open_databasefiles(FILE **indfile, FILE **binfile) {
   if (x != INDFILE_MAGIC) {
     logmsg(MSG_FATAL,"! Database index file does not appear to be properly formatted\n");
   }
-  fread(&n_seq, sizeof(uint), 1, f);
-  MA(seqmeta, sizeof(seqmeta_t)*n_seq);
-  fread(seqmeta, sizeof(seqmeta_t), n_seq, f);
-  *indfile = f;
+  fread(&sdb->n_seq, sizeof(uint), 1, f);
+  MA(sdb->meta, sizeof(seqmeta_t)*sdb->n_seq);
+  fread(sdb->meta, sizeof(seqmeta_t), sdb->n_seq, f);
+  fclose(f);
   
-  strcpy(temp, seq_filename);
+  strcpy(temp, basename);
   strcat(temp, ".sbin");
   f = fopen(temp, "r");
   if (f == NULL) {
@@ -568,16 +3172,230 @@ static void open_databasefiles(FILE **indfile, FILE **binfile) {
   if (x != BINFILE_MAGIC) {
     logmsg(MSG_FATAL,"! Database binary file does not appear to be properly formatted\n");
   }
-  *binfile = f;
+  sdb->binfile = f;
+  sdb->bin_fd = fileno(f);
+
+  sdb->qualfile = NULL;
+  sdb->qual_fd = -1;
+  if (quality) {
+    strcpy(temp, basename);
+    strcat(temp, ".qbin");
+    f = fopen(temp, "r");
+    if (f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening database quality file %s (%s)\n",
+	     temp, strerror(errno));
+    }
+    fread(&x, sizeof(uint), 1, f);
+    if (x != QUALFILE_MAGIC) {
+      logmsg(MSG_FATAL,"! Database quality file does not appear to be properly formatted\n");
+    }
+    sdb->qualfile = f;
+    sdb->qual_fd = fileno(f);
+  }
 
   free(temp);
 }
 
+static void load_sparse_table(FILE *lf, lookup_header_t *h) {
+  sparsemeta_t *keys;
+  sparseslot_t *slot;
+  word_t *data;
+  uint i, n_slots;
+
+  MA(keys, sizeof(sparsemeta_t)*(h->n_keys > 0 ? h->n_keys : 1));
+  MA(lookup, sizeof(word_t)*(h->table_size > 0 ? h->table_size : 1));
+  fread(keys, sizeof(sparsemeta_t), h->n_keys, lf);
+  if (h->bloom_blocks > 0) {
+    MA(bloom, sizeof(uint)*BLOOM_BLOCK_UINTS*h->bloom_blocks);
+    fread(bloom, sizeof(uint), BLOOM_BLOCK_UINTS*h->bloom_blocks, lf);
+  }
+  if (fread(lookup, sizeof(word_t), h->table_size, lf) != h->table_size) {
+    logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", lookup_filename);
+  }
+  if (!use_bloom) {
+    free(bloom);
+    bloom = NULL;
+  }
+
+  /* At most half full, so that probe sequences stay short */
+  for(n_slots=16;n_slots < 2*h->n_keys;n_slots*=2);
+  sparse_mask = n_slots - 1;
+  CA(sparse_slots, n_slots, sizeof(sparseslot_t));
+  data = lookup;
+  for(i=0;i<h->n_keys;i++) {
+    slot = sparse_slots + ((uint) (lookup_word_hash(keys[i].word) >> 32) &
+			   sparse_mask);
+    while(slot->n_words != 0) {
+      slot = (slot == sparse_slots + sparse_mask) ? sparse_slots : slot + 1;
+    }
+    slot->word = keys[i].word;
+    slot->n_words = keys[i].n_words;
+    slot->data = data;
+    data += keys[i].n_words;
+  }
+  free(keys);
+
+  logmsg(MSG_INFO,"Sparse table: %u words in %u slots, Bloom filter %s\n",
+	 h->n_keys, n_slots, bloom ? "in use" : "not used");
+}
+
+/* Loads <lookup file>.fine, the fine layer matching the loaded table */
+static void load_fine_layer(void) {
+  FILE *f;
+  uchar *filename;
+  lookup_header_t h;
+  uint n_offsets;
+
+  MA(filename, strlen(lookup_filename) + 8);
+  sprintf(filename, "%s.fine", lookup_filename);
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    logmsg(MSG_FATAL,"! Failed opening fine layer %s (%s)\n",
+	   filename, strerror(errno));
+  }
+  read_lookup_header(f, filename, &h);
+  if (!(h.flags & LOOKUP_FINE) || h.wordsize >= wordsize || 
+      h.seq_start != ltable_header.seq_start ||
+      h.seq_end != ltable_header.seq_end) {
+    logmsg(MSG_FATAL,"! %s is not the fine layer of %s\n", filename,
+	   lookup_filename);
+  }
+  fine_wordsize = hit_wordsize = h.wordsize;
+  n_offsets = h.seq_end - h.seq_start + 2;
+  MA(fine_offsets, sizeof(uint)*n_offsets);
+  MA(fine_words, sizeof(fineword_t)*(h.table_size > 0 ? h.table_size : 1));
+  if (fread(fine_offsets, sizeof(uint), n_offsets, f) != n_offsets ||
+      fread(fine_words, sizeof(fineword_t), h.table_size, f) != 
+      h.table_size) {
+    logmsg(MSG_FATAL,"! Fine layer %s is truncated\n", filename);
+  }
+  fclose(f);
+  logmsg(MSG_INFO,"Refining candidates with %u words of length %u from %s\n",
+	 h.table_size, fine_wordsize, filename);
+  free(filename);
+}
+
+typedef struct {
+  uchar *filename;
+  FILE *f;
+  lookup_header_t h;
+  lookupmeta_t *meta;
+} segment_t;
+
+static int segment_compare(const void *a, const void *b) {
+  const segment_t *x = a, *y = b;
+
+  if (x->h.seq_start != y->h.seq_start)
+    return x->h.seq_start < y->h.seq_start ? -1 : 1;
+  return 0;
+}
+
+/* Loads several dense tables as a single one: the posting lists of each
+   word are concatenated in sequence order, as merge_lookup would do, so 
+   that find_wordmatches() probes all of them for every query word. Used
+   for the base and delta tables of a manifest. A word censored in one of
+   the tables has no postings there, and keeps those of the others, as if
+   each table were scanned on its own; deltas leave out the words censored
+   in their base when they are built. */
+static void load_tables(uchar **filenames, int n_tables) {
+  segment_t *seg;
+  lookup_header_t *h;
+  word_t **fill;
+  uint w, range, total;
+  int k;
+
+  CA(seg, n_tables, sizeof(segment_t));
+  for(k=0;k<n_tables;k++) {
+    seg[k].filename = filenames[k];
+    seg[k].f = fopen(filenames[k], "r");
+    if (seg[k].f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening lookup file %s (%s)\n",
+	     filenames[k], strerror(errno));
+    }
+    read_lookup_header(seg[k].f, filenames[k], &seg[k].h);
+    if (seg[k].h.flags != 0) {
+      logmsg(MSG_FATAL,"! %s is a sparse or fine layer table, which can only "
+	     "be scanned on its own\n", filenames[k]);
+    }
+    if (seg[k].h.wordsize != seg[0].h.wordsize) {
+      logmsg(MSG_FATAL,"! %s and %s have different word sizes\n",
+	     filenames[k], filenames[0]);
+    }
+  }
+  qsort(seg, n_tables, sizeof(segment_t), segment_compare);
+
+  h = &ltable_header;
+  *h = seg[0].h;
+  wordsize = hit_wordsize = h->wordsize;
+  mask = (0x1 << (wordsize*2)) - 1;
+  CA(lookup_meta, mask+1, sizeof(lookupmeta_t));
+  for(k=0;k<n_tables;k++) {
+    if (seg[k].h.seq_start < h->seq_start) h->seq_start = seg[k].h.seq_start;
+    if (seg[k].h.seq_end > h->seq_end) h->seq_end = seg[k].h.seq_end;
+    if (seg[k].h.word_start < h->word_start) 
+      h->word_start = seg[k].h.word_start;
+    if (seg[k].h.word_end > h->word_end) h->word_end = seg[k].h.word_end;
+    range = seg[k].h.word_end - seg[k].h.word_start;
+    MA(seg[k].meta, sizeof(lookupmeta_t)*range);
+    if (fread(seg[k].meta, sizeof(lookupmeta_t), range, seg[k].f) != range) {
+      logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", seg[k].filename);
+    }
+    for(w=0;w<range;w++) {
+      lookup_meta[w + seg[k].h.word_start].n_words += seg[k].meta[w].n_words;
+    }
+  }
+  total = 0;
+  for(w=0;w<=mask;w++) total += lookup_meta[w].n_words;
+  h->table_size = total;
+  ltable_start = h->seq_start;
+  ltable_end = h->seq_end + 1;
+  logmsg(MSG_INFO,"Loading %d lookup tables covering sequences %lu - %lu\n",
+	 n_tables, ltable_start, ltable_end - 1);
+
+  MA(lookup_data, sizeof(word_t *)*(mask+1));
+  MA(fill, sizeof(word_t *)*(mask+1));
+  MA(lookup, sizeof(word_t)*(total > 0 ? total : 1));
+  lookup_data[0] = fill[0] = lookup;
+  for(w=1;w<=mask;w++) {
+    lookup_data[w] = fill[w] = lookup_data[w-1] + lookup_meta[w-1].n_words;
+  }
+
+  /* Postings of each table are stored in word order */
+  for(k=0;k<n_tables;k++) {
+    range = seg[k].h.word_end - seg[k].h.word_start;
+    for(w=0;w<range;w++) {
+      if (seg[k].meta[w].n_words == 0) continue;
+      if (fread(fill[w + seg[k].h.word_start], sizeof(word_t), 
+		seg[k].meta[w].n_words, seg[k].f) != seg[k].meta[w].n_words) {
+	logmsg(MSG_FATAL,"! Lookup file %s is truncated\n", seg[k].filename);
+      }
+      fill[w + seg[k].h.word_start] += seg[k].meta[w].n_words;
+    }
+    fclose(seg[k].f);
+    free(seg[k].meta);
+  }
+
+  free(fill);
+  free(seg);
+}
+
+static void read_lookup_manifest(void) {
+  manifest_entry_t *entries;
+  int n, i;
+
+  n = read_manifest(manifest_filename, &entries);
+  if (n == 0) {
+    logmsg(MSG_FATAL,"! Manifest %s lists no tables\n", manifest_filename);
+  }
+  MA(lookup_filenames, sizeof(uchar *)*n);
+  for(i=0;i<n;i++) lookup_filenames[i] = entries[i].filename;
+  n_lookupfiles = n;
+  free(entries);
+}
+
 static void open_lookupfile(FILE **lookupfile) {
   FILE *lf;
-  uint x;
-  int table_index;
-  uint table_size;
+  lookup_header_t *h;
   uint i;
 
   lf = fopen(lookup_filename, "r");
@@ -586,32 +3404,37 @@ static void open_lookupfile(FILE **lookupfile) {
 	   lookup_filename, strerror(errno));
   }
   
-  fread(&x, sizeof(uint), 1, lf);
-  if (x != LOOKUP_MAGIC) {
-    logmsg(MSG_FATAL,"! Lookup file does not appear to be properly formatted\n");
-  }
-
-  fread(&wordsize, sizeof(uint), 1, lf);
-  if (wordsize < 2 || wordsize > 24) {
-    logmsg(MSG_FATAL,"! Lookup file does not appear to be properly formatted\n");
-  }
+  h = &ltable_header;
+  read_lookup_header(lf, lookup_filename, h);
+  wordsize = hit_wordsize = h->wordsize;
   mask = (0x1 << (wordsize*2)) - 1;
+  ltable_start = h->seq_start;
+  ltable_end = h->seq_end;
 
-  fread(&ltable_start, sizeof(uint), 1, lf);
-  fread(&ltable_end, sizeof(uint), 1, lf);
-  fread(&table_index, sizeof(int), 1, lf);
-
-  logmsg(MSG_INFO,"Loading lookup table file %d: covering sequences "
-	 "%lu - %lu\n",table_index, ltable_start, ltable_end);
+  if (lookup_header_fullrange(h)) {
+    logmsg(MSG_INFO,"Loading lookup table file %d: covering sequences "
+	   "%lu - %lu\n",h->table_index, ltable_start, ltable_end);
+  } else {
+    logmsg(MSG_INFO,"Loading lookup table file %d: covering sequences "
+	   "%lu - %lu, words %X - %X\n",h->table_index, ltable_start, 
+	   ltable_end, h->word_start, h->word_end - 1);
+  }
   ltable_end += 1;
 
-  fread(&table_size, sizeof(uint), 1, lf);
-  MA(lookup_meta, sizeof(lookupmeta_t)*(mask+1));
-  MA(lookup_data, sizeof(word_t *)*mask+1);
-  MA(lookup, sizeof(word_t)*table_size);
+  if (h->flags & LOOKUP_SPARSE) {
+    load_sparse_table(lf, h);
+    *lookupfile = lf;
+    return;
+  }
+
+  /* Words outside the range of a word-range table simply have no postings */
+  CA(lookup_meta, mask+1, sizeof(lookupmeta_t));
+  MA(lookup_data, sizeof(word_t *)*(mask+1));
+  MA(lookup, sizeof(word_t)*h->table_size);
   
-  fread(lookup_meta, sizeof(lookupmeta_t), mask+1, lf);
-  fread(lookup, sizeof(word_t), table_size, lf);
+  fread(lookup_meta + h->word_start, sizeof(lookupmeta_t), 
+	h->word_end - h->word_start, lf);
+  fread(lookup, sizeof(word_t), h->table_size, lf);
   
   lookup_data[0] = lookup;
   for(i=1;i<=mask;i++) {
@@ -621,86 +3444,557 @@ static void open_lookupfile(FILE **lookupfile) {
   *lookupfile = lf;
 }
 
-static void reverse_complement(uchar *seq, int length) {
-  int i,j;
-  uchar *comp;
+/* Queries are scanned in blocks of query_block. Thread t owns blocks t,
+   t + n_threads, t + 2*n_threads... in a deque; it takes its own blocks 
+   from the front and, once they run out, steals from the back of the deques
+   of the other threads. The output of each block is buffered and written 
+   in block order, so that it is the same whatever the number of threads. */
+typedef struct {
+  pthread_mutex_t lock;
+  int *blocks;
+  int head, tail;
+} block_deque_t;
 
-  comp = alloca(sizeof(uchar)*length);
-  for(i=0;i<length;i++) {
-    j = length - i - 1;
-    comp[i] = seq[j] ^ 0x3;
+typedef struct {
+  char *out;
+  size_t length;
+  int done;
+} block_output_t;
+
+static int n_blocks;
+static block_deque_t *deques;
+static block_output_t *block_output;
+static int next_output = 0;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static scan_state_t *states;
+/* Round of tables being scanned (see scan_table_groups()), and the 
+   queries scanned in it */
+static int scan_round;
+static uint scan_first, scan_end;
+
+/* --checkpoint: the progress of the run, rewritten every 
+   checkpoint_interval seconds or more as output is written, and at the end
+   of every round of tables. The first <offset> bytes of the output are 
+   those of the rounds before <round> and of the queries of <round> before
+   <next_query>; a run started again with the same options and a 
+   checkpoint truncates the output there and goes on from that query. */
+typedef struct {
+  uint magic;
+  uint query_start, query_end;
+  int n_rounds;
+  int round;
+  uint next_query;
+  long long offset;
+} checkpoint_t;
+
+static checkpoint_t checkpoint;
+static int resumed = 0;
+static time_t last_checkpoint;
+
+/* The output is flushed and synced before the checkpoint file is replaced
+   by a complete new one, so that it never points past the output */
+static void write_checkpoint(int round, uint next_query) {
+  uchar *temp;
+  FILE *f;
+
+  if (fflush(stdout) || fsync(fileno(stdout)) < 0) {
+    logmsg(MSG_FATAL,"! Failed writing output to %s (%s)\n", 
+	   output_filename, strerror(errno));
+  }
+  checkpoint.magic = CHECKPOINT_MAGIC;
+  checkpoint.query_start = query_start;
+  checkpoint.query_end = query_end;
+  checkpoint.round = round;
+  checkpoint.next_query = next_query;
+  checkpoint.offset = ftello(stdout);
+
+  MA(temp, strlen(checkpoint_filename) + 5);
+  sprintf(temp, "%s.tmp", checkpoint_filename);
+  f = fopen(temp, "w");
+  if (f == NULL || fwrite(&checkpoint, sizeof(checkpoint_t), 1, f) != 1 ||
+      fflush(f) || fsync(fileno(f)) < 0 || fclose(f) ||
+      rename(temp, checkpoint_filename) < 0) {
+    logmsg(MSG_FATAL,"! Failed writing checkpoint %s (%s)\n", 
+	   checkpoint_filename, strerror(errno));
   }
-  memcpy(seq, comp, length);
+  free(temp);
+  last_checkpoint = time(NULL);
 }
 
-#define MIN(x,y) ((x)<(y)?(x):(y))
-int main(int argc, char *argv[]) {
-  FILE *indfile, *binfile;
-  FILE *lookupfile;
-  hit_report_t *report_hits;
-  uint i, j, n_hits;
-  int seqsize, length;
-  uchar *seq;
+/* Reads the checkpoint left by an earlier run with the same options into
+   <checkpoint>. Returns 0 if there is none. */
+static int read_checkpoint(void) {
+  FILE *f;
 
-  configure_logmsg(MSG_DEBUG1);
-  parse_arguments(argc, argv);
-  configure_logmsg(verbosity_level);
+  f = fopen(checkpoint_filename, "r");
+  if (f == NULL) {
+    if (errno == ENOENT) return 0;
+    logmsg(MSG_FATAL,"! Failed opening checkpoint %s (%s)\n", 
+	   checkpoint_filename, strerror(errno));
+  }
+  if (fread(&checkpoint, sizeof(checkpoint_t), 1, f) != 1 ||
+      checkpoint.magic != CHECKPOINT_MAGIC) {
+    logmsg(MSG_FATAL,"! %s is not a checkpoint of scan_sequences\n", 
+	   checkpoint_filename);
+  }
+  fclose(f);
+  if (checkpoint.query_start != query_start || 
+      checkpoint.query_end != query_end) {
+    logmsg(MSG_FATAL,"! Checkpoint %s is of queries %u - %u, not %u - %u\n",
+	   checkpoint_filename, checkpoint.query_start, checkpoint.query_end,
+	   query_start, query_end);
+  }
+  return 1;
+}
 
-  logmsg(MSG_INFO,"Input database basename set to %s\n",seq_filename);
-  open_databasefiles(&indfile, &binfile);
-  open_lookupfile(&lookupfile);
-  MA(hits_byseq, sizeof(int)*ltable_end);
+static int take_block(int t) {
+  block_deque_t *d;
+  int b, k;
+
+  b = -1;
+  for(k=0;k<n_threads && b < 0;k++) {
+    d = deques + (t + k) % n_threads;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+      b = (k == 0) ? d->blocks[d->head++] : d->blocks[--d->tail];
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+  return b;
+}
+
+/* Hands the output of block <b> over to the output stage, and writes out
+   every block that is now next in order */
+static void finish_block(scan_state_t *st, int b) {
+
+  pthread_mutex_lock(&output_lock);
+  block_output[b].out = st->out;
+  block_output[b].length = st->out_length;
+  block_output[b].done = 1;
+  st->out = NULL;
+  st->out_length = st->out_allocsize = 0;
+  while(next_output < n_blocks && block_output[next_output].done) {
+    if (block_output[next_output].length > 0) {
+      fwrite(block_output[next_output].out, sizeof(char), 
+	     block_output[next_output].length, stdout);
+    }
+    free(block_output[next_output].out);
+    block_output[next_output].out = NULL;
+    next_output++;
+  }
+  if (checkpoint_filename && 
+      time(NULL) - last_checkpoint >= checkpoint_interval) {
+    write_checkpoint(scan_round, 
+		     MIN(scan_first + (uint) next_output*query_block, 
+			 scan_end));
+  }
+  if (stats_filename) {
+    add_stats(&total_stats, &st->stats);
+    if (stats_every && total_stats.queries >= next_stats) {
+      write_stats(0);
+      while(next_stats <= total_stats.queries) next_stats += stats_every;
+    }
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void scan_block(scan_state_t *st, int b) {
+  uint i, first, end;
+  int length;
+  uchar *seq, *qual;
+
+  first = scan_first + b*query_block;
+  end = MIN(first + query_block, scan_end);
+  if (batch) {
+    stage_start(st);
+    scan_batch(st, first, end);
+    stage_done(st, STAGE_LOOKUP);
+  }
+  for(i=first;i<end;i++) {
+    if (batch) {
+      seq = st->batch_seq + st->batch_seq_offsets[i - first];
+      qual = st->batch_qual + st->batch_seq_offsets[i - first];
+      length = query_db->meta[i].seq_length;
+    } else {
+      length = read_query(st, i);
+      seq = st->seq;
+      qual = st->qual;
+    }
+    if (query_db->qual_fd < 0) qual = NULL;
+    if (partial_output) {
+      write_partial(st, seq, qual, i, length);
+    } else {
+      fasta_scan(st, seq, qual, i, length);
+    }
+  }
+}
+
+static void *scan_thread(void *arg) {
+  int t, b;
+
+  t = (int) (long) arg;
+  while((b = take_block(t)) >= 0) {
+    scan_block(states + t, b);
+    finish_block(states + t, b);
+  }
+  return NULL;
+}
+
+static void scan_queries(void) {
+  pthread_t *threads;
+  int t, b;
+  double skipped, lookups, rejects, two_hit_rejects, pruned;
+
+  n_blocks = (scan_end - scan_first + query_block - 1)/query_block;
+  next_output = 0;
+  CA(block_output, n_blocks + 1, sizeof(block_output_t));
+  CA(deques, n_threads, sizeof(block_deque_t));
+  CA(states, n_threads, sizeof(scan_state_t));
+  for(t=0;t<n_threads;t++) {
+    pthread_mutex_init(&deques[t].lock, NULL);
+    MA(deques[t].blocks, sizeof(int)*(n_blocks/n_threads + 1));
+    for(b=t;b<n_blocks;b+=n_threads) {
+      deques[t].blocks[deques[t].tail++] = b;
+    }
+    init_scan_state(states + t);
+  }
+
+  if (n_threads == 1) {
+    scan_thread((void *) 0);
+  } else {
+    MA(threads, sizeof(pthread_t)*n_threads);
+    for(t=0;t<n_threads;t++) {
+      if (pthread_create(threads + t, NULL, scan_thread, (void *) (long) t)) {
+	logmsg(MSG_FATAL,"! Failed creating scanning thread (%s)\n",
+	       strerror(errno));
+      }
+    }
+    for(t=0;t<n_threads;t++) pthread_join(threads[t], NULL);
+    free(threads);
+  }
+  assert(next_output == n_blocks);
+
+  skipped = lookups = rejects = two_hit_rejects = pruned = 0.0;
+  for(t=0;t<n_threads;t++) {
+    skipped += states[t].skipped_words;
+    two_hit_rejects += states[t].two_hit_rejects;
+    pruned += states[t].pruned_targets;
+    lookups += states[t].sparse_lookups;
+    rejects += states[t].bloom_rejects;
+    free_scan_state(states + t);
+    free(deques[t].blocks);
+    pthread_mutex_destroy(&deques[t].lock);
+  }
+  if (query_db->qualfile) {
+    logmsg(MSG_INFO,"Skipped %.0f query words containing bases below "
+	   "quality %d\n",skipped, min_quality);
+  }
+  if (bloom) {
+    logmsg(MSG_INFO,"Bloom filter rejected %.0f of %.0f word lookups\n",
+	   rejects, lookups);
+  }
+  if (two_hit_score) {
+    logmsg(MSG_INFO,"Two-hit extension dropped %.0f targets\n", 
+	   two_hit_rejects);
+  }
+  if (max_targets) {
+    logmsg(MSG_INFO,"Left %.0f targets unchained that could not make the "
+	   "best %d of a query strand\n", pruned, max_targets);
+  }
+  free(states);
+  free(deques);
+  free(block_output);
+}
 
-  MA(report_hits, sizeof(hit_report_t)*ltable_end);
-  seq = NULL;
-  seqsize = 0;
-  for(i=0;i<n_seq;i++) {
-    length = seqmeta[i].seq_length;
-    if (length > seqsize) {
-      seqsize = length;
-      RA(seq, seqsize, sizeof(uchar));
+/* --probe-benchmark: times the word lookups of the counting pass of 
+   find_wordmatches() over every query, at a range of prefetch distances, 
+   after a first untimed pass that brings the queries into the page cache.
+   The query files and counts are handled outside the timed part, and 
+   nothing is written to the output. */
+static void benchmark_probes(void) {
+  static int distances[] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+  scan_state_t st;
+  struct timespec t0, t1;
+  double elapsed, lookups;
+  int d, n_words, length, saved_distance;
+  uint i;
+
+  init_scan_state(&st);
+  saved_distance = prefetch_distance;
+  for(d=-1;d<(int) (sizeof(distances)/sizeof(int));d++) {
+    prefetch_distance = (d < 0) ? 0 : distances[d];
+    elapsed = lookups = 0.0;
+    for(i=query_start;i<query_end;i++) {
+      length = read_query(&st, i);
+      n_words = gather_words(&st, st.seq, 
+			     query_db->qual_fd >= 0 ? st.qual : NULL, length);
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      count_wordhits(&st, n_words, length);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      elapsed += (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+      lookups += 2*n_words;
+      clear_counts(&st);
     }
+    if (d >= 0) {
+      logmsg(MSG_INFO,"Prefetch distance %2d: %.2f s, %.1f ns per word "
+	     "lookup\n", prefetch_distance, elapsed, 
+	     lookups > 0 ? 1e9*elapsed/lookups : 0.0);
+    }
+  }
+  prefetch_distance = saved_distance;
+  free_scan_state(&st);
+}
+
+static void free_tables(void) {
+
+  free(lookup_meta);
+  free(lookup_data);
+  free(lookup);
+  free(sparse_slots);
+  free(bloom);
+  free(fine_offsets);
+  free(fine_words);
+  lookup_meta = NULL;
+  lookup_data = NULL;
+  lookup = NULL;
+  sparse_slots = NULL;
+  bloom = NULL;
+  fine_offsets = NULL;
+  fine_words = NULL;
+}
+
+static uchar *read_whole_file(FILE *f, uchar *basename) {
+  uchar *data;
+  long size;
+
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  MA(data, size > 0 ? size : 1);
+  if (pread(fileno(f), data, size, 0) != size) {
+    logmsg(MSG_FATAL,"! Failed reading the sequences of %s (%s)\n",
+	   basename, strerror(errno));
+  }
+  return data;
+}
+
+/* Maps the .sbin of <sdb>, so that --two-hit extends its word hits
+   without reading the target for each pair of hits */
+static void map_sequences(seqdb_t *sdb) {
+  struct stat sb;
 
-    fread(seq, sizeof(uchar), length, binfile);
-    n_hits = fasta_scan(seq, i, length, report_hits);
-    for(j=0;j<n_hits;j++) {
-      int db_seq, start, end, s_start, s_end, s_length, discount, score;
+  if (fstat(sdb->bin_fd, &sb) < 0) {
+    logmsg(MSG_FATAL,"! Failed reading the sequences of %s (%s)\n",
+	   sdb->basename, strerror(errno));
+  }
+  sdb->map_size = sb.st_size;
+  sdb->map = mmap(NULL, sdb->map_size, PROT_READ, MAP_SHARED, sdb->bin_fd, 0);
+  if (sdb->map == MAP_FAILED) {
+    logmsg(MSG_FATAL,"! Failed mapping the sequences of %s (%s)\n",
+	   sdb->basename, strerror(errno));
+  }
+}
+
+static void read_stores(seqdb_t *sdb) {
+
+  sdb->store = read_whole_file(sdb->binfile, sdb->basename);
+  if (sdb->qualfile) {
+    sdb->qual_store = read_whole_file(sdb->qualfile, sdb->basename);
+  }
+}
+
+static void free_stores(seqdb_t *sdb) {
 
-      db_seq = report_hits[j].db_seq;
-      start = report_hits[j].start;
-      end = report_hits[j].end;
-      s_start = report_hits[j].s_start;
-      s_end = report_hits[j].s_end;
-      s_length = seqmeta[db_seq].seq_length;
-      score = report_hits[j].score;
+  free(sdb->store);
+  free(sdb->qual_store);
+  sdb->store = sdb->qual_store = NULL;
+}
+
+typedef struct {
+  uchar *filename;
+  lookup_header_t h;
+} tableinfo_t;
+
+/* Memory taken by the postings of a table once loaded. Dense tables 
+   loaded together also share the word index, counted once per round. */
+static double table_memory(lookup_header_t *h) {
+  double m;
+
+  m = (double) h->table_size*sizeof(word_t);
+  if (h->flags & LOOKUP_SPARSE) {
+    m += 4.0*h->n_keys*sizeof(sparseslot_t) + 
+      (double) h->bloom_blocks*BLOOM_BLOCK_UINTS*sizeof(uint);
+  }
+  return m;
+}
+
+/* Scans the queries against every lookup file. The dense tables are 
+   loaded together as long as they fit in --memsize, so that every query
+   probes them all in the same pass. When they do not, the tables are 
+   loaded in rounds of consecutive tables that fit, and the query files
+   are read into memory once and scanned again in each round. */
+static void scan_table_groups(void) {
+  tableinfo_t *tables;
+  uchar **filenames;
+  FILE *f;
+  int *round_start;
+  int k, r, n_rounds;
+  double budget, used, index_size;
+
+  MA(tables, sizeof(tableinfo_t)*n_lookupfiles);
+  MA(filenames, sizeof(uchar *)*n_lookupfiles);
+  for(k=0;k<n_lookupfiles;k++) {
+    tables[k].filename = lookup_filenames[k];
+    f = fopen(tables[k].filename, "r");
+    if (f == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening lookup file %s (%s)\n",
+	     tables[k].filename, strerror(errno));
+    }
+    read_lookup_header(f, tables[k].filename, &tables[k].h);
+    fclose(f);
+  }
 
-      discount = MIN(start, s_start) + MIN(length - end - 1, s_length - s_end - 1);
-      fprintf(stdout,"%u %u %d %d %d %d %d %d %d %d %d\n",i,db_seq,score,
-	      discount,score-discount,length,s_length, start, end, 
-	      s_start, s_end);
+  budget = memsize*1048576.0;
+  MA(round_start, sizeof(int)*(n_lookupfiles + 1));
+  n_rounds = 0;
+  used = 0.0;
+  for(k=0;k<n_lookupfiles;k++) {
+    index_size = (double) ((0x1 << (tables[k].h.wordsize*2)))*
+      (sizeof(lookupmeta_t) + 2*sizeof(word_t *) + 1);
+    if (n_rounds == 0 || tables[k].h.flags != 0 || 
+	tables[round_start[n_rounds-1]].h.flags != 0 ||
+	(budget > 0 && used + table_memory(&tables[k].h) > budget)) {
+      round_start[n_rounds++] = k;
+      used = (tables[k].h.flags != 0) ? 0.0 : index_size;
+      if (budget > 0 && used + table_memory(&tables[k].h) > budget) {
+	logmsg(MSG_WARNING,"! Lookup file %s alone does not fit in %d MB\n",
+	       tables[k].filename, memsize);
+      }
     }
+    used += table_memory(&tables[k].h);
+  }
+  round_start[n_rounds] = n_lookupfiles;
 
-    reverse_complement(seq, length);
-    n_hits = fasta_scan(seq, i, length, report_hits);
-    for(j=0;j<n_hits;j++) {
-      int db_seq, start, end, s_start, s_end, s_length, discount, score;
+  if (n_rounds > 1) {
+    if (partial_output) {
+      logmsg(MSG_FATAL,"! --partial needs all the lookup tables loaded at "
+	     "once, but they take %d rounds: raise --memsize\n", n_rounds);
+    }
+    logmsg(MSG_INFO,"Scanning against %d lookup tables in %d rounds\n",
+	   n_lookupfiles, n_rounds);
+    read_stores(query_db);
+    /* Targets are only read to align hits, --two-hit maps them */
+    if (query_db != &target_db && verify) {
+      read_stores(&target_db);
+    }
+  }
 
-      db_seq = report_hits[j].db_seq;
-      start = report_hits[j].start;
-      end = report_hits[j].end;
-      s_start = report_hits[j].s_start;
-      s_end = report_hits[j].s_end;
-      s_length = seqmeta[db_seq].seq_length;
-      score = report_hits[j].score;
+  if (resumed && checkpoint.n_rounds != n_rounds) {
+    logmsg(MSG_FATAL,"! Checkpoint %s is of a scan in %d rounds of tables, "
+	   "not %d\n", checkpoint_filename, checkpoint.n_rounds, n_rounds);
+  }
+  checkpoint.n_rounds = n_rounds;
 
-      discount = MIN(start, s_start) + MIN(length - end - 1, s_length - s_end - 1);
-      fprintf(stdout,"%u %u %d %d %d %d %d %d %d %d %d RC\n",i,db_seq,score,
-	      discount,score-discount,length,s_length, start, end, 
-	      s_start, s_end);
+  for(r=resumed ? checkpoint.round : 0;r<n_rounds;r++) {
+    if (round_start[r+1] - round_start[r] == 1) {
+      lookup_filename = tables[round_start[r]].filename;
+      open_lookupfile(&f);
+      fclose(f);
+    } else {
+      for(k=round_start[r];k<round_start[r+1];k++) {
+	filenames[k - round_start[r]] = tables[k].filename;
+      }
+      load_tables(filenames, round_start[r+1] - round_start[r]);
+    }
+    if (refine) load_fine_layer();
+
+    scan_round = r;
+    scan_first = query_start;
+    scan_end = query_end;
+    if (resumed && r == checkpoint.round) scan_first = checkpoint.next_query;
+    if (partial_output) {
+      count_threshold = 1;
+      if (!resumed) write_partial_header(stdout);
+    }
+    if (binary_output && r == 0 && !resumed) {
+      write_hitfile_header(stdout, n_seq, wordsize, verify);
+    }
+    if (probe_benchmark) {
+      benchmark_probes();
+    } else {
+      scan_queries();
     }
+    free_tables();
+    if (checkpoint_filename) write_checkpoint(r + 1, query_start);
+  }
+
+  if (stats_filename) write_stats(1);
+  free_stores(query_db);
+  free_stores(&target_db);
+  free(round_start);
+  free(filenames);
+  free(tables);
+}
 
+/* Output is collected per block of queries and written in large chunks */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 
+int main(int argc, char *argv[]) {
+
+  configure_logmsg(MSG_DEBUG1);
+  parse_arguments(argc, argv);
+  configure_logmsg(verbosity_level);
+
+  logmsg(MSG_INFO,"Input database basename set to %s\n",seq_filename);
+  open_databasefiles(seq_filename, &target_db, 
+		     query_filename == NULL && min_quality > 0);
+  n_seq = target_db.n_seq;
+  seqmeta = target_db.meta;
+  if (two_hit_score) map_sequences(&target_db);
+  if (query_filename) {
+    logmsg(MSG_INFO,"Query database basename set to %s\n",query_filename);
+    CA(query_db, 1, sizeof(seqdb_t));
+    open_databasefiles(query_filename, query_db, min_quality > 0);
+  }
+  if (query_end > query_db->n_seq) query_end = query_db->n_seq;
+  if (query_start > query_end) {
+    logmsg(MSG_FATAL,"! --query-start %u is past --query-end or the last "
+	   "query (%u)\n", query_start, query_end);
+  }
+
+  if (checkpoint_filename) resumed = read_checkpoint();
+  if (output_filename) {
+    if (freopen(output_filename, resumed ? "r+" : "w", stdout) == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening output file %s (%s)\n",
+	     output_filename, strerror(errno));
+    }
+  }
+  if (resumed) {
+    if (ftruncate(fileno(stdout), checkpoint.offset) < 0 ||
+	fseeko(stdout, checkpoint.offset, SEEK_SET) < 0) {
+      logmsg(MSG_FATAL,"! Failed truncating %s to its checkpoint (%s)\n",
+	     output_filename, strerror(errno));
+    }
+    logmsg(MSG_INFO,"Taking up the scan at query %u of table round %d "
+	   "from checkpoint %s\n", checkpoint.next_query, checkpoint.round,
+	   checkpoint_filename);
+  }
+  last_checkpoint = time(NULL);
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  if (stats_filename) {
+    stats_file = fopen(stats_filename, "w");
+    if (stats_file == NULL) {
+      logmsg(MSG_FATAL,"! Failed opening stats file %s (%s)\n", 
+	     stats_filename, strerror(errno));
+    }
+    stats_started = stage_clock();
+    next_stats = stats_every;
+  }
+  if (merge_partials) {
+    merge_partial_scans(argc - optind, argv + optind);
+    return 0;
   }
+  if (manifest_filename) read_lookup_manifest();
+  scan_table_groups();
 
   return 0;
 }